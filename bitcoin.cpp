@@ -30,6 +30,9 @@ class CNode {
   int ban;
   int64 doneAfter;
   CAddress you;
+  int64 nVersionSent; // GetTimeMillis() when our version was sent
+  int nConnectMs;
+  int nHandshakeMs;
 
   int GetTimeout() {
       if (you.IsTor())
@@ -111,6 +114,8 @@ class CNode {
       CAddress addrMe;
       CAddress addrFrom;
       uint64 nNonce = 1;
+      if (nHandshakeMs < 0)
+        nHandshakeMs = GetTimeMillis() - nVersionSent;
       vRecv >> nVersion >> you.nServices >> nTime >> addrMe;
       if (nVersion == 10300) nVersion = 300;
       if (nVersion >= 106 && !vRecv.empty())
@@ -210,7 +215,7 @@ class CNode {
   }
   
 public:
-  CNode(const CService& ip, vector<CAddress>* vAddrIn) : you(ip), nHeaderStart(-1), nMessageStart(-1), vAddr(vAddrIn), ban(0), doneAfter(0), nVersion(0) {
+  CNode(const CService& ip, vector<CAddress>* vAddrIn) : you(ip), nHeaderStart(-1), nMessageStart(-1), vAddr(vAddrIn), ban(0), doneAfter(0), nVersion(0), nVersionSent(0), nConnectMs(-1), nHandshakeMs(-1) {
     vSend.SetType(SER_NETWORK);
     vSend.SetVersion(0);
     vRecv.SetType(SER_NETWORK);
@@ -228,7 +233,10 @@ public:
   }
   bool Run() {
     bool res = true;
+    int64 nStart = GetTimeMillis();
     if (!ConnectSocket(you, sock)) return false;
+    nVersionSent = GetTimeMillis();
+    nConnectMs = nVersionSent - nStart;
     PushVersion();
     Send();
     int64 now;
@@ -294,9 +302,19 @@ public:
   uint64_t GetServices() {
     return you.nServices;
   }
+
+  int GetConnectMs() {
+    return nConnectMs;
+  }
+
+  int GetHandshakeMs() {
+    return nHandshakeMs;
+  }
 };
 
-bool TestNode(const CService &cip, int &ban, int &clientV, std::string &clientSV, int &blocks, vector<CAddress>* vAddr, uint64_t& services) {
+bool TestNode(const CService &cip, int &ban, int &clientV, std::string &clientSV, int &blocks, vector<CAddress>* vAddr, uint64_t& services, int &connectMs, int &handshakeMs) {
+  connectMs = -1;
+  handshakeMs = -1;
   try {
     CNode node(cip, vAddr);
     bool ret = node.Run();
@@ -309,6 +327,8 @@ bool TestNode(const CService &cip, int &ban, int &clientV, std::string &clientSV
     clientSV = node.GetClientSubVersion();
     blocks = node.GetStartingHeight();
     services = node.GetServices();
+    connectMs = node.GetConnectMs();
+    handshakeMs = node.GetHandshakeMs();
 //  printf("%s: %s!!!\n", cip.ToString().c_str(), ret ? "GOOD" : "BAD");
     return ret;
   } catch(std::ios_base::failure& e) {
@@ -3,6 +3,8 @@
 
 #include "protocol.h"
 
-bool TestNode(const CService &cip, int &ban, int &client, std::string &clientSV, int &blocks, std::vector<CAddress>* vAddr, uint64_t& services);
+// connectMs and handshakeMs are set to how long the TCP connect and the
+// exchange of version messages took, or -1 if they did not complete
+bool TestNode(const CService &cip, int &ban, int &client, std::string &clientSV, int &blocks, std::vector<CAddress>* vAddr, uint64_t& services, int &connectMs, int &handshakeMs);
 
 #endif
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cookie.h"
+
+#define COOKIE_VERSION 1
+#define COOKIE_LIFETIME 3600
+#define COOKIE_FUTURE 300
+
+static uint64_t master[2];
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND                                                        \
+  do {                                                                  \
+    v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32);           \
+    v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2;                              \
+    v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0;                              \
+    v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32);           \
+  } while (0)
+
+static uint64_t read64le(const unsigned char *p) {
+  uint64_t ret = 0;
+  for (int i = 7; i >= 0; i--)
+    ret = (ret << 8) | p[i];
+  return ret;
+}
+
+static uint64_t siphash24(uint64_t k0, uint64_t k1, const unsigned char *data, size_t len) {
+  uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+  uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+  uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+  uint64_t v3 = 0x7465646279746573ULL ^ k1;
+  const unsigned char *end = data + (len & ~7);
+  for (; data != end; data += 8) {
+    uint64_t m = read64le(data);
+    v3 ^= m;
+    SIPROUND; SIPROUND;
+    v0 ^= m;
+  }
+  uint64_t b = ((uint64_t)len) << 56;
+  for (int i = (len & 7) - 1; i >= 0; i--)
+    b |= ((uint64_t)data[i]) << (8 * i);
+  v3 ^= b;
+  SIPROUND; SIPROUND;
+  v0 ^= b;
+  v2 ^= 0xff;
+  SIPROUND; SIPROUND; SIPROUND; SIPROUND;
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+void cookie_init() {
+  FILE *f = fopen("/dev/urandom", "r");
+  if (!f || fread(master, sizeof(master), 1, f) != 1) {
+    master[0] = ((uint64_t)rand() << 32) ^ rand() ^ time(NULL);
+    master[1] = ((uint64_t)rand() << 32) ^ rand();
+  }
+  if (f)
+    fclose(f);
+}
+
+// hash key for an hour, derived from the master secret
+struct cookie_key_t {
+  uint32_t hour;
+  int set;
+  uint64_t k0, k1;
+};
+
+// per thread, the keys of the last two hours used, by hour parity: a
+// cookie being checked was issued this hour or the last one
+static thread_local cookie_key_t keys[2];
+
+static const cookie_key_t *cookie_key(uint32_t hour) {
+  cookie_key_t *key = &keys[hour & 1];
+  if (!key->set || key->hour != hour) {
+    unsigned char epoch[4] = { (unsigned char)(hour >> 24), (unsigned char)(hour >> 16), (unsigned char)(hour >> 8), (unsigned char)hour };
+    key->k0 = siphash24(master[0], master[1], epoch, sizeof(epoch));
+    key->k1 = siphash24(master[1], master[0], epoch, sizeof(epoch));
+    key->hour = hour;
+    key->set = 1;
+  }
+  return key;
+}
+
+// hash of the server cookie fields; buf holds client cookie, version,
+// reserved and timestamp, followed by room for the client address
+static uint64_t cookie_hash(unsigned char *buf, const struct sockaddr_in6 *addr, uint32_t timestamp) {
+  int len = COOKIE_CLIENT_LEN + 8;
+  if (IN6_IS_ADDR_V4MAPPED(&addr->sin6_addr)) {
+    memcpy(buf + len, addr->sin6_addr.s6_addr + 12, 4);
+    len += 4;
+  } else {
+    memcpy(buf + len, addr->sin6_addr.s6_addr, 16);
+    len += 16;
+  }
+  // key for the hour the cookie was issued in
+  const cookie_key_t *key = cookie_key(timestamp / COOKIE_LIFETIME);
+  return siphash24(key->k0, key->k1, buf, len);
+}
+
+int cookie_valid(const unsigned char *cookie, int len, const struct sockaddr_in6 *addr, uint32_t now) {
+  if (len != COOKIE_CLIENT_LEN + COOKIE_SERVER_LEN || cookie[COOKIE_CLIENT_LEN] != COOKIE_VERSION)
+    return 0;
+  const unsigned char *server = cookie + COOKIE_CLIENT_LEN;
+  uint32_t timestamp = ((uint32_t)server[4] << 24) | ((uint32_t)server[5] << 16) | ((uint32_t)server[6] << 8) | server[7];
+  // serial number arithmetic, as the timestamp wraps in 2106
+  int32_t age = (int32_t)(now - timestamp);
+  if (age > COOKIE_LIFETIME || age < -COOKIE_FUTURE)
+    return 0;
+  unsigned char buf[COOKIE_CLIENT_LEN + 8 + 16];
+  memcpy(buf, cookie, COOKIE_CLIENT_LEN + 8);
+  uint64_t hash = cookie_hash(buf, addr, timestamp);
+  unsigned char expect[8];
+  for (int i = 0; i < 8; i++)
+    expect[i] = hash >> (56 - 8 * i);
+  return memcmp(expect, server + 8, 8) == 0;
+}
+
+void cookie_make(const unsigned char *client, const struct sockaddr_in6 *addr, uint32_t now, unsigned char *out) {
+  unsigned char buf[COOKIE_CLIENT_LEN + 8 + 16];
+  memcpy(buf, client, COOKIE_CLIENT_LEN);
+  unsigned char *server = buf + COOKIE_CLIENT_LEN;
+  server[0] = COOKIE_VERSION;
+  server[1] = server[2] = server[3] = 0;
+  server[4] = now >> 24; server[5] = now >> 16; server[6] = now >> 8; server[7] = now;
+  uint64_t hash = cookie_hash(buf, addr, now);
+  memcpy(out, buf, COOKIE_CLIENT_LEN + 8);
+  for (int i = 0; i < 8; i++)
+    out[COOKIE_CLIENT_LEN + 8 + i] = hash >> (56 - 8 * i);
+}
@@ -0,0 +1,27 @@
+#ifndef _COOKIE_H_
+#define _COOKIE_H_ 1
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+// DNS Cookies (RFC 7873), with server cookies in the interoperable format
+// of RFC 9018: version, reserved, timestamp and a SipHash-2-4 over the
+// client cookie and address. The hash key is derived from a random master
+// secret and the hour of the timestamp, so the secret rotates every hour
+// without any state shared between threads; each thread caches the keys
+// of the last two hours.
+
+#define COOKIE_CLIENT_LEN 8
+#define COOKIE_SERVER_LEN 16
+
+void cookie_init();
+
+// 1 if cookie (client cookie followed by a server cookie) was issued by
+// us to this address within the last hour
+int cookie_valid(const unsigned char *cookie, int len, const struct sockaddr_in6 *addr, uint32_t now);
+
+// write the client cookie followed by a fresh server cookie to out
+// (COOKIE_CLIENT_LEN + COOKIE_SERVER_LEN bytes)
+void cookie_make(const unsigned char *client, const struct sockaddr_in6 *addr, uint32_t now, unsigned char *out);
+
+#endif
@@ -1,5 +1,8 @@
 #include "db.h"
 #include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+#include <iterator>
 
 using namespace std;
 
@@ -30,6 +33,69 @@ void CAddrInfo::Update(bool good) {
 //  100.0 * stat1W.reliability, 100.0 * (stat1W.reliability + 1.0 - stat1W.weight), stat1W.count);
 }
 
+// exponential moving average, new samples counting for a quarter
+static void UpdateAverage(float &avg, int sample) {
+  if (sample < 0)
+    return;
+  avg = avg < 0 ? sample : avg + (sample - avg) / 4;
+}
+
+void CAddrInfo::UpdateRtt(int connect, int handshake) {
+  UpdateAverage(connectMs, connect);
+  UpdateAverage(handshakeMs, handshake);
+}
+
+double CAddrInfo::GetWeight(int mode, int64 now) const {
+  // a floor keeps every good node in rotation
+  double uptime = (stat1D.reliability + stat1W.reliability + stat1M.reliability) / 3;
+  double wUptime = 0.05 + uptime * uptime;
+  double wRecent = 0.05 + (ourLastSuccess ? exp(-(double)(now - ourLastSuccess) / (8 * 3600)) : 0);
+  // unknown counts as 250 ms, halving the weight
+  double wLatency = 250 / (250 + (handshakeMs < 0 ? 250 : handshakeMs));
+  switch (mode) {
+    case WEIGHT_UPTIME: return wUptime;
+    case WEIGHT_LATENCY: return wUptime * wLatency;
+    case WEIGHT_RECENT: return wRecent;
+    case WEIGHT_BOTH: return wUptime * wRecent;
+    default: return 1;
+  }
+}
+
+// Vose's construction: split the weights into columns of equal height,
+// each holding at most two indices
+void CAliasTable::Build(const std::vector<double> &weights) {
+  int n = weights.size();
+  prob.assign(n, 1.0f);
+  alias.resize(n);
+  double total = 0;
+  for (int i = 0; i < n; i++)
+    total += weights[i];
+  if (n == 0 || total <= 0)
+    return;
+  std::vector<double> scaled(n);
+  std::vector<int> small, large;
+  for (int i = 0; i < n; i++) {
+    alias[i] = i;
+    scaled[i] = weights[i] * n / total;
+    if (scaled[i] < 1)
+      small.push_back(i);
+    else
+      large.push_back(i);
+  }
+  while (!small.empty() && !large.empty()) {
+    int s = small.back(), l = large.back();
+    small.pop_back();
+    prob[s] = scaled[s];
+    alias[s] = l;
+    scaled[l] -= 1 - scaled[s];
+    if (scaled[l] < 1) {
+      large.pop_back();
+      small.push_back(l);
+    }
+  }
+  // what is left is 1 up to rounding
+}
+
 bool CAddrDb::Get_(CServiceResult &ip, int &wait) {
   int64 now = time(NULL);
   int cont = 0;
@@ -39,7 +105,7 @@ bool CAddrDb::Get_(CServiceResult &ip, int &wait) {
     return false;
   }
   do {
-    int rnd = rand() % tot;
+    int rnd = GetFastRandRange(tot);
     int ret;
     if (rnd < unkId.size()) {
       set<int>::iterator it = unkId.end(); it--;
@@ -69,19 +135,27 @@ int CAddrDb::Lookup_(const CService &ip) {
   return -1;
 }
 
-void CAddrDb::Good_(const CService &addr, int clientV, std::string clientSV, int blocks, uint64_t services) {
+void CAddrDb::Good_(const CService &addr, int clientV, std::string clientSV, int blocks, uint64_t services, int connectMs, int handshakeMs) {
   int id = Lookup_(addr);
   if (id == -1) return;
   unkId.erase(id);
+  if (warmId.erase(id))
+    fGoodChanged = true;
   banned.erase(addr);
   CAddrInfo &info = idToInfo[id];
   info.clientVersion = clientV;
   info.clientSubVersion = clientSV;
   info.blocks = blocks;
+  if (info.services != services && goodId.count(id))
+    fGoodChanged = true;
   info.services = services;
   info.Update(true);
+  info.UpdateRtt(connectMs, handshakeMs);
+  if (info.IsGood() && !nFirstGoodMs)
+    nFirstGoodMs = GetTimeMillis();
   if (info.IsGood() && goodId.count(id)==0) {
     goodId.insert(id);
+    fGoodChanged = true;
 //    printf("%s: good; %i good nodes now\n", ToString(addr).c_str(), (int)goodId.size());
   }
   nDirty++;
@@ -93,6 +167,8 @@ void CAddrDb::Bad_(const CService &addr, int ban)
   int id = Lookup_(addr);
   if (id == -1) return;
   unkId.erase(id);
+  if (warmId.erase(id))
+    fGoodChanged = true;
   CAddrInfo &info = idToInfo[id];
   info.Update(false);
   uint32_t now = time(NULL);
@@ -105,11 +181,13 @@ void CAddrDb::Bad_(const CService &addr, int ban)
 //    printf("%s: ban for %i seconds\n", ToString(addr).c_str(), ban);
     banned[info.ip] = ban + now;
     ipToId.erase(info.ip);
-    goodId.erase(id);
+    if (goodId.erase(id))
+      fGoodChanged = true;
     idToInfo.erase(id);
   } else {
     if (/*!info.IsGood() && */ goodId.count(id)==1) {
       goodId.erase(id);
+      fGoodChanged = true;
 //      printf("%s: not good; %i good nodes left\n", ToString(addr).c_str(), (int)goodId.size());
     }
     ourId.push_back(id);
@@ -191,13 +269,141 @@ void CAddrDb::GetIPs_(set<CNetAddr>& ips, uint64_t requestedFlags, int max, cons
   if (max < 1)
     max = 1;
 
-  set<int> ids;
-  while (ids.size() < max) {
-    ids.insert(goodIdFiltered[rand() % goodIdFiltered.size()]);
-  }
-  for (set<int>::const_iterator it = ids.begin(); it != ids.end(); it++) {
-    CService &ip = idToInfo[*it].ip;
+  // partial Fisher-Yates: the first max entries become a uniform sample
+  int size = goodIdFiltered.size();
+  for (int i = 0; i < max; i++) {
+    int j = i + GetFastRandRange(size - i);
+    std::swap(goodIdFiltered[i], goodIdFiltered[j]);
+    CService &ip = idToInfo[goodIdFiltered[i]].ip;
     if (nets[ip.GetNetwork()])
       ips.insert(ip);
   }
 }
+
+void CAddrDb::Publish_() {
+  CAddrSnapshot *snap = new CAddrSnapshot;
+  snap->nSeq = ++nSnapshots;
+  for (std::set<uint64_t>::const_iterator it = snapshotFilters.begin(); it != snapshotFilters.end(); it++)
+    snap->filters[*it];
+  // while nothing is known to be good, hand out the node we would try next,
+  // as GetIPs_ does
+  std::vector<int> ids;
+  std::set_union(goodId.begin(), goodId.end(), warmId.begin(), warmId.end(), std::back_inserter(ids));
+  // the first snapshot has nothing to turn over from
+  if (snap->nSeq > 1) {
+    // a replaced node counts once, by leaving: cached answers only go
+    // stale when the nodes in them leave
+    std::vector<int> left;
+    std::set_difference(publishedIds.begin(), publishedIds.end(), ids.begin(), ids.end(), std::back_inserter(left));
+    if (!left.empty())
+      UpdateChurn_((double)left.size() / publishedIds.size());
+  }
+  publishedIds = ids;
+  nFallbackId = -1;
+  if (ids.empty()) {
+    if (!ourId.empty())
+      nFallbackId = ourId.front();
+    else if (!unkId.empty())
+      nFallbackId = *unkId.begin();
+    if (nFallbackId >= 0)
+      ids.push_back(nFallbackId);
+  }
+  int64 now = time(NULL);
+  std::map<uint64_t, std::vector<double> > weights4, weights6;
+  std::map<std::vector<unsigned char>, int> groups;
+  if (regions) {
+    for (std::map<uint64_t, CGoodSet>::iterator fit = snap->filters.begin(); fit != snap->filters.end(); fit++) {
+      fit->second.region4.resize(region_count(regions));
+      fit->second.region6.resize(region_count(regions));
+      fit->second.area4.resize(region_area_count(regions));
+      fit->second.area6.resize(region_area_count(regions));
+    }
+  }
+  for (std::vector<int>::const_iterator it = ids.begin(); it != ids.end(); it++) {
+    const CAddrInfo &info = idToInfo[*it];
+    double weight = info.GetWeight(nWeightMode, now);
+    CGoodAddr4 addr4;
+    CGoodAddr6 addr6;
+    int net = info.ip.GetNetwork();
+    if (!(net == NET_IPV4 && info.ip.GetInAddr((struct in_addr*)addr4.ip)) && !(net == NET_IPV6 && info.ip.GetIn6Addr((struct in6_addr*)addr6.ip)))
+      continue;
+    int group = groups.insert(std::make_pair(info.ip.GetGroup(), (int)groups.size())).first->second;
+    uint16_t rtt = info.handshakeMs < 0 || info.handshakeMs >= 0xffff ? 0xffff : (uint16_t)info.handshakeMs;
+    int region = -1;
+    if (regions)
+      region = net == NET_IPV4 ? region_lookup(regions, 4, addr4.ip, NULL) : region_lookup(regions, 6, addr6.ip, NULL);
+    for (std::map<uint64_t, CGoodSet>::iterator fit = snap->filters.begin(); fit != snap->filters.end(); fit++) {
+      if ((info.services & fit->first) != fit->first)
+        continue;
+      if (net == NET_IPV4) {
+        fit->second.ipv4.push_back(addr4);
+        fit->second.group4.push_back(group);
+        fit->second.rtt4.push_back(rtt);
+        if (region >= 0) {
+          fit->second.region4[region].push_back(fit->second.ipv4.size() - 1);
+          fit->second.area4[region_area(regions, region)].push_back(fit->second.ipv4.size() - 1);
+        }
+        weights4[fit->first].push_back(weight);
+      } else {
+        fit->second.ipv6.push_back(addr6);
+        fit->second.group6.push_back(group);
+        fit->second.rtt6.push_back(rtt);
+        if (region >= 0) {
+          fit->second.region6[region].push_back(fit->second.ipv6.size() - 1);
+          fit->second.area6[region_area(regions, region)].push_back(fit->second.ipv6.size() - 1);
+        }
+        weights6[fit->first].push_back(weight);
+      }
+    }
+  }
+  snap->nGroups = groups.size();
+  if (nWeightMode != WEIGHT_UNIFORM) {
+    for (std::map<uint64_t, CGoodSet>::iterator fit = snap->filters.begin(); fit != snap->filters.end(); fit++) {
+      std::vector<double> &w4 = weights4[fit->first], &w6 = weights6[fit->first];
+      fit->second.pick4.Build(w4);
+      fit->second.pick6.Build(w6);
+      w4.insert(w4.end(), w6.begin(), w6.end());
+      fit->second.pickAll.Build(w4);
+    }
+  }
+  const CAddrSnapshot *old = snapshot.exchange(snap);
+  if (old)
+    retired.push_back(old);
+  // free the replaced snapshots that no reader announced
+  for (int i = retired.size() - 1; i >= 0; i--) {
+    bool inUse = false;
+    for (int r = 0; r < nReaders && !inUse; r++)
+      inUse = readers[r].inUse.load() == retired[i];
+    if (!inUse) {
+      delete retired[i];
+      retired.erase(retired.begin() + i);
+    }
+  }
+  fGoodChanged = false;
+}
+
+// Aim for about a tenth of an answer having left the good set by the time
+// it expires.
+void CAddrDb::UpdateChurn_(double turnover) {
+  int64 now = time(NULL);
+  if (nChurnTime)
+    churn *= exp(-(double)(now - nChurnTime) / 3600);
+  churn += turnover;
+  nChurnTime = now;
+  double ttl = churn > 0 ? 0.1 * 3600 / churn : nMaxTtl;
+  nTtl.store(ttl < nMinTtl ? nMinTtl : (ttl > nMaxTtl ? nMaxTtl : (int)ttl), std::memory_order_relaxed);
+}
+
+void CAddrDb::PublishIfChanged_() {
+  if (!readers)
+    return;
+  if (fGoodChanged) {
+    Publish_();
+    return;
+  }
+  if (goodId.empty() && warmId.empty()) {
+    int id = !ourId.empty() ? ourId.front() : (!unkId.empty() ? *unkId.begin() : -1);
+    if (id != nFallbackId)
+      Publish_();
+  }
+}
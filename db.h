@@ -5,10 +5,12 @@
 #include <map>
 #include <vector>
 #include <deque>
+#include <atomic>
 
 #include "netbase.h"
 #include "protocol.h"
 #include "util.h"
+#include "region.h"
 
 #define MIN_RETRY 1000
 
@@ -91,6 +93,8 @@ public:
   int64_t lastSuccess;
   bool fGood;
   uint64_t services;
+  float connectMs;
+  float handshakeMs;
 };
 
 
@@ -112,8 +116,11 @@ private:
   int total;
   int success;
   std::string clientSubVersion;
+  // averages over successful tests, in ms; -1 until measured
+  float connectMs; // TCP connect
+  float handshakeMs; // from sending our version to receiving theirs
 public:
-  CAddrInfo() : services(0), lastTry(0), ourLastTry(0), ourLastSuccess(0), ignoreTill(0), clientVersion(0), blocks(0), total(0), success(0) {}
+  CAddrInfo() : services(0), lastTry(0), ourLastTry(0), ourLastSuccess(0), ignoreTill(0), clientVersion(0), blocks(0), total(0), success(0), connectMs(-1), handshakeMs(-1) {}
   
   CAddrReport GetReport() const {
     CAddrReport ret;
@@ -129,6 +136,8 @@ public:
     ret.lastSuccess = ourLastSuccess;
     ret.fGood = IsGood();
     ret.services = services;
+    ret.connectMs = connectMs;
+    ret.handshakeMs = handshakeMs;
     return ret;
   }
  
@@ -191,11 +200,16 @@ https://stackoverflow.com/questions/2340281/check-if-a-string-contains-a-string-
   }
   
   void Update(bool good);
+  void UpdateRtt(int connect, int handshake);
+
+  // how often DNS answers should include this node, relative to other
+  // good nodes (see WEIGHT_*); never 0
+  double GetWeight(int mode, int64 now) const;
   
   friend class CAddrDb;
   
   IMPLEMENT_SERIALIZE (
-    unsigned char version = 4;
+    unsigned char version = 5;
     READWRITE(version);
     READWRITE(ip);
     READWRITE(services);
@@ -223,6 +237,10 @@ https://stackoverflow.com/questions/2340281/check-if-a-string-contains-a-string-
           READWRITE(blocks);
       if (version >= 4)
           READWRITE(ourLastSuccess);
+      if (version >= 5) {
+          READWRITE(connectMs);
+          READWRITE(handshakeMs);
+      }
     }
   )
 };
@@ -246,6 +264,81 @@ struct CServiceResult {
     int nClientV;
     std::string strClientV;
     int64 ourLastSuccess;
+    int nConnectMs;
+    int nHandshakeMs;
+};
+
+// How DNS answers pick among the good nodes
+enum {
+  WEIGHT_UNIFORM = 0, // all alike
+  WEIGHT_UPTIME,      // by daily, weekly and monthly reliability
+  WEIGHT_RECENT,      // by how recently we last reached the node
+  WEIGHT_BOTH,        // by both
+  WEIGHT_LATENCY,     // by reliability and handshake time
+};
+
+// Walker's alias table, for drawing indices with fixed weights in O(1)
+class CAliasTable {
+public:
+  std::vector<float> prob;
+  std::vector<int> alias;
+
+  void Build(const std::vector<double> &weights);
+  bool empty() const { return prob.empty(); }
+
+  int Draw() const {
+    int i = GetFastRandRange(prob.size());
+    float u = (GetFastRand() >> 40) * (1.0f / (1 << 24));
+    return u < prob[i] ? i : alias[i];
+  }
+};
+
+// Addresses of good nodes, as published to the DNS threads
+struct CGoodAddr4 {
+  unsigned char ip[4];
+};
+
+struct CGoodAddr6 {
+  unsigned char ip[16];
+};
+
+// The good nodes matching one filter, in one packed array per family
+struct CGoodSet {
+  std::vector<CGoodAddr4> ipv4;
+  std::vector<CGoodAddr6> ipv6;
+  // weighted draws from ipv4, ipv6, and both (IPv4 first); empty when
+  // answers are uniform
+  CAliasTable pick4, pick6, pickAll;
+  // network group (CNetAddr::GetGroup) of each address, numbered per
+  // snapshot
+  std::vector<int> group4, group6;
+  // handshake time of each address in ms, 0xffff if unknown
+  std::vector<uint16_t> rtt4, rtt6;
+  // indices into ipv4 and ipv6 per region and per area of the region
+  // table; empty without one
+  std::vector<std::vector<int> > region4, region6, area4, area6;
+};
+
+// Immutable snapshot of the good nodes, per filter. CAddrDb publishes a
+// new one whenever the good set changes, and readers use it without locks.
+class CAddrSnapshot {
+public:
+  uint64_t nSeq; // publication number
+  int nGroups; // distinct network groups among the addresses
+  std::map<uint64_t, CGoodSet> filters;
+
+  const CGoodSet *Get(uint64_t requestedFlags) const {
+    std::map<uint64_t, CGoodSet>::const_iterator it = filters.find(requestedFlags);
+    return it == filters.end() ? NULL : &it->second;
+  }
+};
+
+// Hazard slot of a snapshot reader: the snapshot it may still be using,
+// which the publisher must not free. On its own cache line.
+struct CSnapshotReader {
+  std::atomic<const CAddrSnapshot*> inUse;
+  char pad[64 - sizeof(std::atomic<const CAddrSnapshot*>)];
+  CSnapshotReader() : inUse(NULL) {}
 };
 
 //             seen nodes
@@ -265,22 +358,49 @@ private:
   std::deque<int> ourId; // sequence of tried nodes, in order we have tried connecting to them (c,d)
   std::set<int> unkId; // set of nodes not yet tried (b)
   std::set<int> goodId; // set of good nodes  (d, good e)
+  std::set<int> warmId; // published before a restart, and not tested since
   int nDirty;
+
+  // published snapshots of goodId
+  std::set<uint64_t> snapshotFilters; // filters to publish (0 for unfiltered)
+  std::atomic<const CAddrSnapshot*> snapshot;
+  std::vector<const CAddrSnapshot*> retired; // replaced, but maybe still read
+  CSnapshotReader *readers;
+  int nReaders;
+  std::atomic<int> nReadersUsed;
+  int nWeightMode; // WEIGHT_*
+  const region_t *regions; // to sort nodes into, or NULL
+  bool fGoodChanged; // goodId, or the services of a good node, changed
+  int nFallbackId; // node published while goodId is empty, or -1
+  uint64_t nSnapshots;
+
+  // turnover of the published good set, which sets the answer TTL
+  std::vector<int> publishedIds; // goodId and warmId as last published, sorted
+  double churn; // fraction of the good set replaced, summed with a 1 hour decay
+  int64 nChurnTime; // when churn last decayed
+  int nMinTtl, nMaxTtl;
+  std::atomic<int> nTtl;
+  int64_t nFirstGoodMs; // GetTimeMillis() when a test first found a good node, or 0
   
 protected:
   // internal routines that assume proper locks are acquired
   void Add_(const CAddress &addr, bool force);   // add an address
   bool Get_(CServiceResult &ip, int& wait);      // get an IP to test (must call Good_, Bad_, or Skipped_ on result afterwards)
   bool GetMany_(std::vector<CServiceResult> &ips, int max, int& wait);
-  void Good_(const CService &ip, int clientV, std::string clientSV, int blocks, uint64_t services); // mark an IP as good (must have been returned by Get_)
+  void Good_(const CService &ip, int clientV, std::string clientSV, int blocks, uint64_t services, int connectMs, int handshakeMs); // mark an IP as good (must have been returned by Get_)
   void Bad_(const CService &ip, int ban);  // mark an IP as bad (and optionally ban it) (must have been returned by Get_)
   void Skipped_(const CService &ip);       // mark an IP as skipped (must have been returned by Get_)
   int Lookup_(const CService &ip);         // look up id of an IP
   void GetIPs_(std::set<CNetAddr>& ips, uint64_t requestedFlags, int max, const bool *nets); // get a random set of IPs (shared lock only)
+  void Publish_();                         // publish a new snapshot (exclusive lock)
+  void PublishIfChanged_();
+  void UpdateChurn_(double turnover);      // add turnover to churn, and derive nTtl
 
 public:
   std::map<CService, time_t> banned; // nodes that are banned, with their unban time (a)
 
+  CAddrDb() : nId(0), nDirty(0), snapshot(NULL), readers(NULL), nReaders(0), nReadersUsed(0), nWeightMode(WEIGHT_UNIFORM), regions(NULL), fGoodChanged(false), nFallbackId(-1), nSnapshots(0), churn(0), nChurnTime(0), nMinTtl(3600), nMaxTtl(3600), nTtl(3600), nFirstGoodMs(0) {}
+
   void GetStats(CAddrDbStats &stats) {
     SHARED_CRITICAL_BLOCK(cs) {
       stats.nBanned = banned.size();
@@ -313,14 +433,15 @@ public:
   
   // serialization code
   // format:
-  //   nVersion (0 for now)
+  //   nVersion (1 for now)
   //   n (number of ips in (b,c,d))
   //   CAddrInfo[n]
   //   banned
+  //   the last published good set (version 1+), served again at startup
   // acquires a shared lock (this does not suffice for read mode, but we assume that only happens at startup, single-threaded)
   // this way, dumping does not interfere with GetIPs_, which is called from the DNS thread
   IMPLEMENT_SERIALIZE (({
-    int nVersion = 0;
+    int nVersion = 1;
     READWRITE(nVersion);
     SHARED_CRITICAL_BLOCK(cs) {
       if (fWrite) {
@@ -358,29 +479,57 @@ public:
         db->nDirty++;
       }
       READWRITE(banned);
+      if (nVersion >= 1) {
+        std::vector<CService> vPublished;
+        if (fWrite) {
+          CAddrDb *db = const_cast<CAddrDb*>(this);
+          for (std::vector<int>::const_iterator it = publishedIds.begin(); it != publishedIds.end(); it++)
+            if (db->idToInfo.count(*it))
+              vPublished.push_back(db->idToInfo[*it].ip);
+        }
+        READWRITE(vPublished);
+        if (fRead) {
+          // the nodes that are not good by their stats are served until
+          // their next test
+          CAddrDb *db = const_cast<CAddrDb*>(this);
+          for (std::vector<CService>::const_iterator it = vPublished.begin(); it != vPublished.end(); it++) {
+            std::map<CService, int>::const_iterator ii = db->ipToId.find(*it);
+            if (ii != db->ipToId.end() && !db->goodId.count(ii->second))
+              db->warmId.insert(ii->second);
+          }
+        }
+      }
     }
   });)
 
   void Add(const CAddress &addr, bool fForce = false) {
-    CRITICAL_BLOCK(cs)
+    CRITICAL_BLOCK(cs) {
       Add_(addr, fForce);
+      PublishIfChanged_();
+    }
   }
   void Add(const std::vector<CAddress> &vAddr, bool fForce = false) {
-    CRITICAL_BLOCK(cs)
+    CRITICAL_BLOCK(cs) {
       for (int i=0; i<vAddr.size(); i++)
         Add_(vAddr[i], fForce);
+      PublishIfChanged_();
+    }
   }
-  void Good(const CService &addr, int clientVersion, std::string clientSubVersion, int blocks, uint64_t services) {
-    CRITICAL_BLOCK(cs)
-      Good_(addr, clientVersion, clientSubVersion, blocks, services);
+  void Good(const CService &addr, int clientVersion, std::string clientSubVersion, int blocks, uint64_t services, int connectMs = -1, int handshakeMs = -1) {
+    CRITICAL_BLOCK(cs) {
+      Good_(addr, clientVersion, clientSubVersion, blocks, services, connectMs, handshakeMs);
+      PublishIfChanged_();
+    }
   }
   void Skipped(const CService &addr) {
     CRITICAL_BLOCK(cs)
       Skipped_(addr);
   }
   void Bad(const CService &addr, int ban = 0) {
-    CRITICAL_BLOCK(cs)
+    CRITICAL_BLOCK(cs) {
       Bad_(addr, ban);
+      PublishIfChanged_();
+    }
   }
   bool Get(CServiceResult &ip, int& wait) {
     CRITICAL_BLOCK(cs)
@@ -401,15 +550,100 @@ public:
     CRITICAL_BLOCK(cs) {
       for (int i=0; i<ips.size(); i++) {
         if (ips[i].fGood) {
-          Good_(ips[i].service, ips[i].nClientV, ips[i].strClientV, ips[i].nHeight, ips[i].services);
+          Good_(ips[i].service, ips[i].nClientV, ips[i].strClientV, ips[i].nHeight, ips[i].services, ips[i].nConnectMs, ips[i].nHandshakeMs);
         } else {
           Bad_(ips[i].service, ips[i].nBanTime);
         }
       }
+      PublishIfChanged_();
     }
   }
   void GetIPs(std::set<CNetAddr>& ips, uint64_t requestedFlags, int max, const bool *nets) {
     SHARED_CRITICAL_BLOCK(cs)
       GetIPs_(ips, requestedFlags, max, nets);
   }
+
+  // Publish snapshots for these filters from now on, to up to nReaders
+  // reader threads, weighting nodes by nWeightModeIn and sorting them
+  // into the regions of regionsIn (if not NULL). Call once, before any
+  // reader starts.
+  void InitSnapshots(const std::set<uint64_t> &filters, int nReadersIn, int nWeightModeIn, const region_t *regionsIn) {
+    CRITICAL_BLOCK(cs) {
+      snapshotFilters = filters;
+      nWeightMode = nWeightModeIn;
+      regions = regionsIn;
+      readers = new CSnapshotReader[nReadersIn];
+      nReaders = nReadersIn;
+      Publish_();
+    }
+  }
+
+  // Take a reader slot for the calling thread, or -1 if all nReaders are
+  // taken; a reader without a slot must not call GetSnapshot
+  int RegisterReader() {
+    int reader = nReadersUsed++;
+    return reader < nReaders ? reader : -1;
+  }
+
+  // The current snapshot, without locking. It stays valid until the same
+  // reader calls GetSnapshot again.
+  const CAddrSnapshot *GetSnapshot(int reader) {
+    std::atomic<const CAddrSnapshot*> &inUse = readers[reader].inUse;
+    const CAddrSnapshot *snap = snapshot.load();
+    do {
+      // announce, then check it was not replaced (and maybe freed) meanwhile
+      inUse.store(snap);
+      const CAddrSnapshot *now = snapshot.load();
+      if (now == snap)
+        return snap;
+      snap = now;
+    } while (1);
+  }
+
+  // Bounds for the TTL of answers, which shortens as the good set churns
+  void SetTtlBounds(int nMinTtlIn, int nMaxTtlIn) {
+    CRITICAL_BLOCK(cs) {
+      nMinTtl = nMinTtlIn;
+      nMaxTtl = nMaxTtlIn;
+      UpdateChurn_(0);
+    }
+  }
+
+  // Let churn decay while nothing is published; call every few seconds
+  void UpdateTtl() {
+    CRITICAL_BLOCK(cs)
+      UpdateChurn_(0);
+  }
+
+  // TTL for answers; any thread, without locking
+  int GetTtl() const {
+    return nTtl.load(std::memory_order_relaxed);
+  }
+
+  // Nodes served only because they were published before the restart
+  int GetWarmCount() {
+    SHARED_CRITICAL_BLOCK(cs)
+      return warmId.size();
+    return 0;
+  }
+
+  // GetTimeMillis() when a test first found a good node, or 0
+  int64_t GetFirstGoodTime() {
+    SHARED_CRITICAL_BLOCK(cs)
+      return nFirstGoodMs;
+    return 0;
+  }
+
+  // fraction of the good set replaced in about the last hour
+  double GetChurn() {
+    SHARED_CRITICAL_BLOCK(cs)
+      return churn;
+    return 0;
+  }
+
+  uint64_t GetSnapshotCount() {
+    SHARED_CRITICAL_BLOCK(cs)
+      return nSnapshots;
+    return 0;
+  }
 };
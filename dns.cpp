@@ -11,17 +11,49 @@
 #include <time.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <vector>
+#if defined(__linux__)
+# include <linux/filter.h>
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #include "dns.h"
+#include "cookie.h"
+#include "region.h"
+#include "qlog.h"
+#include "dnssec.h"
+#if defined(__linux__)
+# include "uring.h"
+#endif
 
 #define BUFLEN 512
+#define MAX_PAYLOAD 4096
+#define MAX_TCP_PAYLOAD 65535
+#define MAX_TCP_CONN 1024
+#define MAX_TCP_PER_PREFIX 32
+
+#define MAX_BATCH 1024
 
 #if defined(IP_RECVDSTADDR)
 # define DSTADDR_SOCKOPT IP_RECVDSTADDR
+# define DSTADDR_RECVOPT IP_RECVDSTADDR
+# define DSTADDR_LEVEL IPPROTO_IP
 # define DSTADDR_DATASIZE (CMSG_SPACE(sizeof(struct in6_addr)))
 # define dstaddr(x) (CMSG_DATA(x))
 #elif defined(IPV6_PKTINFO)
 # define DSTADDR_SOCKOPT IPV6_PKTINFO
+# if defined(IPV6_RECVPKTINFO)
+#  define DSTADDR_RECVOPT IPV6_RECVPKTINFO
+# else
+#  define DSTADDR_RECVOPT IPV6_PKTINFO
+# endif
+# define DSTADDR_LEVEL IPPROTO_IPV6
 # define DSTADDR_DATASIZE (CMSG_SPACE(sizeof(struct in6_pktinfo)))
 # define dstaddr(x) (&(((struct in6_pktinfo *)(CMSG_DATA(x)))->ipi6_addr))
 #else
@@ -46,57 +78,22 @@ typedef enum {
   TYPE_MX = 15,
   TYPE_AAAA = 28,
   TYPE_SRV = 33,
+  TYPE_OPT = 41,
+  TYPE_RRSIG = 46,
+  TYPE_NSEC = 47,
+  TYPE_DNSKEY = 48,
   QTYPE_ANY = 255
 } dns_type;
 
+typedef enum {
+  EDNS_ECS = 8,
+  EDNS_COOKIE = 10
+} edns_option;
+
 
 //  0: ok
 // -1: premature end of input, forward reference, component > 63 char, invalid character
 // -2: insufficient space in output
-int static parse_name(const unsigned char **inpos, const unsigned char *inend, const unsigned char *inbuf, char *buf, size_t bufsize) {
-  size_t bufused = 0;
-  int init = 1;
-  do {
-    if (*inpos == inend)
-      return -1;
-    // read length of next component
-    int octet = *((*inpos)++);
-    if (octet == 0) {
-      buf[bufused] = 0;
-      return 0;
-    }
-    // add dot in output
-    if (!init) {
-      if (bufused == bufsize-1)
-        return -2;
-      buf[bufused++] = '.';
-    } else
-      init = 0;
-    // handle references
-    if ((octet & 0xC0) == 0xC0) {
-      if (*inpos == inend)
-        return -1;
-      int ref = ((octet - 0xC0) << 8) + *((*inpos)++);
-      if (ref < 0 || ref >= (*inpos)-inbuf-2) return -1;
-      const unsigned char *newbuf = inbuf + ref;
-      return parse_name(&newbuf, (*inpos) - 2, inbuf, buf+bufused, bufsize-bufused);
-    }
-    if (octet > 63) return -1;
-    // copy label
-    while (octet) {
-      if (*inpos == inend)
-        return -1;
-      if (bufused == bufsize-1)
-        return -2;
-      int c = *((*inpos)++);
-      if (c == '.')
-        return -1;
-      octet--;
-      buf[bufused++] = c;
-    }
-  } while(1);
-}
-
 //  0: k
 // -1: component > 63 characters
 // -2: insufficent space in output
@@ -255,7 +252,184 @@ int static write_record_soa(unsigned char** outpos, const unsigned char *outend,
   return error;
 }
 
+// copy a record rendered by dns_prerender or dns_render_addr
+//  0: ok
+// -2: insufficient space in output (or nothing rendered)
+int static write_rendered(unsigned char** outpos, const unsigned char *outend, const unsigned char *rr, int len) {
+  if (len <= 0 || outend - *outpos < len) return -2;
+  memcpy(*outpos, rr, len);
+  *outpos += len;
+  return 0;
+}
+
+// Records are rendered with their owner name compressed to the question
+// name, which always starts right after the 12-byte header.
+#define QNAME_OFFSET 12
+
+void dns_prerender(dns_opt_t *opt) {
+  // our zone in lowercase wire format, to match query names against
+  unsigned char *outpos = opt->zone;
+  opt->zonelen = 0;
+  if (!write_name(&outpos, opt->zone + sizeof(opt->zone), opt->host, -1)) {
+    opt->zonelen = outpos - opt->zone;
+    for (int i = 0; i < opt->zonelen; i++)
+      opt->zone[i] = tolower(opt->zone[i]);
+  }
+  outpos = opt->ns_rr;
+  opt->ns_rrlen = write_record_ns(&outpos, opt->ns_rr + sizeof(opt->ns_rr), "", QNAME_OFFSET, CLASS_IN, opt->nsttl, opt->ns) ? 0 : outpos - opt->ns_rr;
+  outpos = opt->soa_rr;
+  opt->soa_rrlen = 0;
+  if (opt->mbox && !write_record_soa(&outpos, opt->soa_rr + sizeof(opt->soa_rr), "", QNAME_OFFSET, CLASS_IN, opt->nsttl, opt->ns, opt->mbox, time(NULL), 604800, 86400, 2592000, 604800))
+    opt->soa_rrlen = outpos - opt->soa_rr;
+}
+
+int dns_render_addr(const dns_opt_t *opt, const addr_t *addr, dns_rr_t *rr) {
+  unsigned char *outpos = rr->data;
+  int ret = -6;
+  if (addr->v == 4)
+    ret = write_record_a(&outpos, rr->data + sizeof(rr->data), "", QNAME_OFFSET, CLASS_IN, opt->datattl, addr);
+  else if (addr->v == 6)
+    ret = write_record_aaaa(&outpos, rr->data + sizeof(rr->data), "", QNAME_OFFSET, CLASS_IN, opt->datattl, addr);
+  rr->v = addr->v;
+  rr->len = ret ? 0 : outpos - rr->data;
+  return ret;
+}
+
+// FNV-1a
+static unsigned int label_hash(const char *label, int len) {
+  unsigned int h = 2166136261u;
+  for (int i = 0; i < len; i++)
+    h = (h ^ (unsigned char)label[i]) * 16777619u;
+  return h;
+}
+
+static void insert_label(dns_label_t *labels, unsigned int mask, const char *label, int len, int id) {
+  unsigned int i = label_hash(label, len) & mask;
+  while (labels[i].len && (labels[i].len != len || memcmp(labels[i].label, label, len)))
+    i = (i + 1) & mask;
+  labels[i].len = len;
+  memcpy(labels[i].label, label, len);
+  labels[i].id = id;
+}
+
+void dns_add_label(dns_opt_t *opt, const char *label, int id) {
+  char lower[63];
+  int len = strlen(label);
+  if (len == 0 || len > 63)
+    return;
+  for (int i = 0; i < len; i++)
+    lower[i] = tolower((unsigned char)label[i]);
+  // keep the table at most half full
+  if (2 * (opt->nlabels + 1) > (opt->labels ? opt->labelmask + 1 : 0)) {
+    unsigned int size = opt->labels ? 2 * (opt->labelmask + 1) : 16;
+    dns_label_t *labels = new dns_label_t[size]();
+    for (unsigned int i = 0; opt->labels && i <= opt->labelmask; i++)
+      if (opt->labels[i].len)
+        insert_label(labels, size - 1, opt->labels[i].label, opt->labels[i].len, opt->labels[i].id);
+    delete[] opt->labels;
+    opt->labels = labels;
+    opt->labelmask = size - 1;
+  }
+  insert_label(opt->labels, opt->labelmask, lower, len, id);
+  opt->nlabels++;
+}
+
+// id of a label of len characters, already lowercase, or DNS_LABEL_NONE
+static int find_label(const dns_opt_t *opt, const char *label, int len) {
+  if (!opt->labels || len > 63)
+    return DNS_LABEL_NONE;
+  unsigned int i = label_hash(label, len) & opt->labelmask;
+  while (opt->labels[i].len) {
+    if (opt->labels[i].len == len && !memcmp(opt->labels[i].label, label, len))
+      return opt->labels[i].id;
+    i = (i + 1) & opt->labelmask;
+  }
+  return DNS_LABEL_NONE;
+}
+
+// Copy n bytes of a name in wire format from src to dst, lowercasing ASCII
+// letters (length octets, all below 64, are left alone), and mark the
+// positions of '.' bytes in the 256-bit map dots.
+static void lower_name(unsigned char *dst, const unsigned char *src, int n, uint64_t *dots) {
+  int i = 0;
+#if defined(__AVX2__)
+  // bytes in 'A'..'Z' map to -128..-103 once shifted by 128 - 'A'
+  const __m256i shift = _mm256_set1_epi8((char)(128 - 'A')), limit = _mm256_set1_epi8(-128 + 26);
+  const __m256i bit = _mm256_set1_epi8(0x20), dot = _mm256_set1_epi8('.');
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+    __m256i upper = _mm256_cmpgt_epi8(limit, _mm256_add_epi8(v, shift));
+    _mm256_storeu_si256((__m256i*)(dst + i), _mm256_or_si256(v, _mm256_and_si256(upper, bit)));
+    uint64_t m = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, dot));
+    dots[i / 64] |= m << (i % 64);
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i shift16 = _mm_set1_epi8((char)(128 - 'A')), limit16 = _mm_set1_epi8(-128 + 26);
+  const __m128i bit16 = _mm_set1_epi8(0x20), dot16 = _mm_set1_epi8('.');
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i upper = _mm_cmpgt_epi8(limit16, _mm_add_epi8(v, shift16));
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_or_si128(v, _mm_and_si128(upper, bit16)));
+    uint64_t m = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, dot16));
+    dots[i / 64] |= m << (i % 64);
+  }
+#endif
+  for (; i < n; i++) {
+    unsigned char c = src[i];
+    dst[i] = (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+    if (c == '.')
+      dots[i / 64] |= 1ULL << (i % 64);
+  }
+}
+
+// Parse the question name at *inpos, leaving *inpos after it, and check it
+// against our zone by comparing its lowercased wire form with opt->zone.
+// Sets *label for names in the zone.
+//  0: in our zone
+//  1: not in our zone
+// -1: malformed: truncated, a label over 63 bytes or containing '.', or compressed
+// -2: longer than 255 bytes
+static int parse_qname(const dns_opt_t *opt, const unsigned char **inpos, const unsigned char *inend, int *label) {
+  const unsigned char *name = *inpos;
+  uint64_t starts[4] = {}; // positions of length octets
+  int len = 0;
+  do {
+    if (name + len >= inend)
+      return -1;
+    int octet = name[len];
+    if (octet == 0)
+      break;
+    if (octet > 63)
+      return -1;
+    if (len + 1 + octet >= 255)
+      return -2;
+    starts[len / 64] |= 1ULL << (len % 64);
+    len += 1 + octet;
+  } while(1);
+  len++;
+  *inpos = name + len;
+  unsigned char lower[256];
+  uint64_t dots[4] = {};
+  lower_name(lower, name, len, dots);
+  if ((dots[0] & ~starts[0]) | (dots[1] & ~starts[1]) | (dots[2] & ~starts[2]) | (dots[3] & ~starts[3]))
+    return -1;
+  // the zone must end the name, starting at a label
+  int sub = len - opt->zonelen;
+  if (sub < 0 || (sub > 0 && !(starts[sub / 64] & (1ULL << (sub % 64)))) || memcmp(lower + sub, opt->zone, opt->zonelen))
+    return 1;
+  if (sub == 0)
+    *label = DNS_LABEL_APEX;
+  else if (lower[0] + 1 == sub)
+    *label = find_label(opt, (const char*)lower + 1, lower[0]);
+  else
+    *label = DNS_LABEL_NONE;
+  return 0;
+}
+
 static ssize_t set_error(unsigned char* outbuf, int error) {
+  // set qr
+  outbuf[2] |= 128;
   // set error
   outbuf[3] |= error & 0xF;
   // set counts
@@ -266,8 +440,339 @@ static ssize_t set_error(unsigned char* outbuf, int error) {
   return 12;
 }
 
-ssize_t static dnshandle(dns_opt_t *opt, const unsigned char *inbuf, size_t insize, unsigned char* outbuf) {
+// EDNS0 (RFC 6891) state of a request
+struct edns_t {
+  int present;
+  int udpsize;
+  int version;
+  int flags;
+  // COOKIE option of the request: client cookie, maybe followed by a server cookie
+  const unsigned char *cookie;
+  int cookielen;
+  // COOKIE option for the reply
+  unsigned char replycookie[COOKIE_CLIENT_LEN + COOKIE_SERVER_LEN];
+  int replycookielen;
+  // EDNS Client Subnet option (RFC 7871), echoed in the reply with
+  // ecsscope filled in; ecsfamily is 0 without one
+  int ecsfamily;
+  int ecssource;
+  int ecsscope;
+  unsigned char ecsaddr[16];
+  int dnssecok; // the reply is signed: echo the DO bit
+};
+
+int static skip_name(const unsigned char **inpos, const unsigned char *inend) {
+  do {
+    if (*inpos == inend)
+      return -1;
+    int octet = *((*inpos)++);
+    if (octet == 0)
+      return 0;
+    if ((octet & 0xC0) == 0xC0) {
+      if (*inpos == inend)
+        return -1;
+      (*inpos)++;
+      return 0;
+    }
+    if (octet > 63 || inend - *inpos < octet)
+      return -1;
+    *inpos += octet;
+  } while(1);
+}
+
+//  0: ok
+// -1: malformed record or option, or more than one OPT record
+int static parse_edns(const unsigned char *inbuf, const unsigned char *inpos, const unsigned char *inend, struct edns_t *edns) {
+  edns->present = 0;
+  edns->cookie = NULL;
+  edns->cookielen = 0;
+  edns->replycookielen = 0;
+  edns->ecsfamily = 0;
+  edns->dnssecok = 0;
+  int nrecords = ((inbuf[6] << 8) + inbuf[7]) + ((inbuf[8] << 8) + inbuf[9]) + ((inbuf[10] << 8) + inbuf[11]);
+  while (nrecords--) {
+    if (skip_name(&inpos, inend) || inend - inpos < 10)
+      return -1;
+    int typ = (inpos[0] << 8) + inpos[1];
+    int rdlength = (inpos[8] << 8) + inpos[9];
+    if (inend - inpos < 10 + rdlength)
+      return -1;
+    if (typ == TYPE_OPT) {
+      if (edns->present)
+        return -1;
+      edns->present = 1;
+      edns->udpsize = (inpos[2] << 8) + inpos[3];
+      edns->version = inpos[5];
+      edns->flags = (inpos[6] << 8) + inpos[7];
+      const unsigned char *optpos = inpos + 10;
+      const unsigned char *optend = optpos + rdlength;
+      while (optend - optpos >= 4) {
+        int code = (optpos[0] << 8) + optpos[1];
+        int len = (optpos[2] << 8) + optpos[3];
+        optpos += 4;
+        if (optend - optpos < len)
+          return -1;
+        if (code == EDNS_COOKIE) {
+          if (edns->cookie || (len != COOKIE_CLIENT_LEN && (len < COOKIE_CLIENT_LEN + 8 || len > COOKIE_CLIENT_LEN + 32)))
+            return -1;
+          edns->cookie = optpos;
+          edns->cookielen = len;
+        }
+        if (code == EDNS_ECS) {
+          // family 1 (IPv4) or 2 (IPv6), source and scope prefix lengths,
+          // then the source prefix in as few bytes as it takes, with no
+          // bits set beyond it; queries must have scope 0
+          if (edns->ecsfamily || len < 4)
+            return -1;
+          int family = (optpos[0] << 8) + optpos[1];
+          int source = optpos[2];
+          int bytes = (source + 7) / 8;
+          if ((family != 1 && family != 2) || source > (family == 1 ? 32 : 128) || optpos[3] != 0 || len != 4 + bytes)
+            return -1;
+          if (source % 8 && (optpos[4 + bytes - 1] & (0xFF >> (source % 8))))
+            return -1;
+          edns->ecsfamily = family;
+          edns->ecssource = source;
+          edns->ecsscope = 0;
+          memset(edns->ecsaddr, 0, sizeof(edns->ecsaddr));
+          memcpy(edns->ecsaddr, optpos + 4, bytes);
+        }
+        optpos += len;
+      }
+      if (optpos != optend)
+        return -1;
+    }
+    inpos += 10 + rdlength;
+  }
+  return 0;
+}
+
+// size of the OPT record write_opt will produce
+int static opt_size(const struct edns_t *edns) {
+  return 11 + (edns->replycookielen ? 4 + edns->replycookielen : 0) + (edns->ecsfamily ? 8 + (edns->ecssource + 7) / 8 : 0);
+}
+
+int static write_opt(unsigned char** outpos, const unsigned char *outend, int udpsize, int error, const struct edns_t *edns) {
+  int rdlength = opt_size(edns) - 11;
+  if (outend - *outpos < 11 + rdlength) return -2;
+  *((*outpos)++) = 0;
+  *((*outpos)++) = TYPE_OPT >> 8; *((*outpos)++) = TYPE_OPT & 0xFF;
+  *((*outpos)++) = udpsize >> 8; *((*outpos)++) = udpsize & 0xFF;
+  // extended rcode, version 0, no flags but DO
+  *((*outpos)++) = error >> 4; *((*outpos)++) = 0;
+  *((*outpos)++) = edns->dnssecok ? 0x80 : 0; *((*outpos)++) = 0;
+  *((*outpos)++) = rdlength >> 8; *((*outpos)++) = rdlength & 0xFF;
+  if (edns->replycookielen) {
+    *((*outpos)++) = EDNS_COOKIE >> 8; *((*outpos)++) = EDNS_COOKIE & 0xFF;
+    *((*outpos)++) = edns->replycookielen >> 8; *((*outpos)++) = edns->replycookielen & 0xFF;
+    memcpy(*outpos, edns->replycookie, edns->replycookielen);
+    *outpos += edns->replycookielen;
+  }
+  if (edns->ecsfamily) {
+    int bytes = (edns->ecssource + 7) / 8;
+    *((*outpos)++) = EDNS_ECS >> 8; *((*outpos)++) = EDNS_ECS & 0xFF;
+    *((*outpos)++) = 0; *((*outpos)++) = 4 + bytes;
+    *((*outpos)++) = 0; *((*outpos)++) = edns->ecsfamily;
+    *((*outpos)++) = edns->ecssource; *((*outpos)++) = edns->ecsscope;
+    memcpy(*outpos, edns->ecsaddr, bytes);
+    *outpos += bytes;
+  }
+  return 0;
+}
+
+// What dnshandle tells its caller about a reply, beyond its bytes
+struct dns_reply_t {
+  int xrcode; // upper bits of an extended rcode, held by the OPT record
+  int qtype; // DNS_QT_* of the question, DNS_QT_NONE if none was parsed
+};
+
+// the metrics bucket of a question type
+int static qtype_index(int type) {
+  switch (type) {
+    case TYPE_A: return DNS_QT_A;
+    case TYPE_NS: return DNS_QT_NS;
+    case TYPE_SOA: return DNS_QT_SOA;
+    case TYPE_AAAA: return DNS_QT_AAAA;
+    case QTYPE_ANY: return DNS_QT_ANY;
+    default: return DNS_QT_OTHER;
+  }
+}
+
+// set_error, keeping an OPT record in the reply when the request had one
+static ssize_t set_error_edns(dns_opt_t *opt, unsigned char* outbuf, int error, const struct edns_t *edns, dns_reply_t *reply) {
+  reply->xrcode = error >> 4;
+  ssize_t len = set_error(outbuf, error);
+  if (!edns->present)
+    return len;
+  unsigned char *outpos = outbuf + len;
+  write_opt(&outpos, outbuf + BUFLEN, opt->maxudp, error, edns);
+  outbuf[11] = 1;
+  return outpos - outbuf;
+}
+
+// Minimal truncated reply (header and question only), for requests that
+// are over the rate limit. Real clients retry over TCP; spoofed floods
+// gain no amplification.
+ssize_t static dnsslip(const unsigned char *inbuf, size_t insize, unsigned char* outbuf) {
+  if (insize < 12 || (inbuf[2] & 128) || ((inbuf[4] << 8) + inbuf[5]) != 1)
+    return -1;
+  const unsigned char *inpos = inbuf + 12;
+  const unsigned char *inend = inbuf + insize;
+  if (skip_name(&inpos, inend) || inend - inpos < 4)
+    return -1;
+  inpos += 4;
+  memcpy(outbuf, inbuf, inpos - inbuf);
+  // set qr and tc, unset aa and ra, clear error
+  outbuf[2] = (outbuf[2] | 128 | 2) & ~4;
+  outbuf[3] &= ~(128 | 15);
+  outbuf[6] = 0;  outbuf[7] = 0;
+  outbuf[8] = 0;  outbuf[9] = 0;
+  outbuf[10] = 0; outbuf[11] = 0;
+  return inpos - inbuf;
+}
+
+// The answer and authority sections from signed RRsets, and the OPT
+// record. Owner names point to the question name at QNAME_OFFSET, or to
+// the zone's part of it at zoneoff.
+ssize_t static dnshandle_signed(dns_opt_t *opt, const dnssec_answers_t *sig, int label, int typ, unsigned char *outbuf, unsigned char *outpos,
+                                const unsigned char *outend, int zoneoff, const struct edns_t *edns) {
+  const dnssec_name_t *name = label == DNS_LABEL_APEX ? &sig->apex : &sig->labels[label];
+  const dnssec_rrset_t *answer[6];
+  int nanswer = 0;
+  unsigned int pick = opt->dnssecpick++;
+  // the NSEC lists NSEC and RRSIG among the types at every name, so those
+  // are answered too: an RRSIG query gets the signatures of all its RRsets
+  int rrsigs = typ == TYPE_RRSIG;
+  if ((typ == TYPE_A || typ == QTYPE_ANY || rrsigs) && !name->a.empty())
+    answer[nanswer++] = &name->a[pick % name->a.size()];
+  if ((typ == TYPE_AAAA || typ == QTYPE_ANY || rrsigs) && !name->aaaa.empty())
+    answer[nanswer++] = &name->aaaa[pick % name->aaaa.size()];
+  if (label == DNS_LABEL_APEX && (typ == TYPE_NS || rrsigs))
+    answer[nanswer++] = &sig->ns;
+  if (label == DNS_LABEL_APEX && (typ == TYPE_SOA || rrsigs))
+    answer[nanswer++] = &sig->soa;
+  if (label == DNS_LABEL_APEX && (typ == TYPE_DNSKEY || rrsigs))
+    answer[nanswer++] = &sig->dnskey;
+  if (typ == TYPE_NSEC || rrsigs)
+    answer[nanswer++] = &name->nsec;
+  int count = 0;
+  for (int i = 0; i < nanswer; i++) {
+    if (rrsigs ? dnssec_write_rrsig(&outpos, outend, answer[i], QNAME_OFFSET) : dnssec_write(&outpos, outend, answer[i], QNAME_OFFSET, NULL)) {
+      // set TC
+      outbuf[2] |= 2;
+      break;
+    }
+    count += rrsigs ? answer[i]->nrr > 0 : answer[i]->nrr;
+  }
+  outbuf[6] = count >> 8;
+  outbuf[7] = count & 0xFF;
+  // Authority section: our NS if it fits, or for no data the SOA and the
+  // NSEC proving there is none
+  int nauth = 0;
+  if (count && !(label == DNS_LABEL_APEX && typ == TYPE_NS)) {
+    if (!dnssec_write(&outpos, outend, &sig->ns, zoneoff, NULL))
+      nauth += sig->ns.nrr;
+  } else if (!count && !(outbuf[2] & 2)) {
+    unsigned char *start = outpos;
+    if (dnssec_write(&outpos, outend, &sig->soa, zoneoff, NULL) || dnssec_write(&outpos, outend, &name->nsec, QNAME_OFFSET, NULL)) {
+      outpos = start;
+      outbuf[2] |= 2;
+    } else {
+      nauth += sig->soa.nrr + name->nsec.nrr;
+    }
+  }
+  outbuf[8] = nauth >> 8;
+  outbuf[9] = nauth & 0xFF;
+  write_opt(&outpos, outend + opt_size(edns), opt->maxudp, 0, edns);
+  outbuf[11]++;
+  // set AA
+  outbuf[2] |= 4;
+  return outpos - outbuf;
+}
+
+// A signed NXDOMAIN for a name in the zone with no label of ours: the SOA,
+// the NSEC covering the name and the one covering the wildcard that could
+// have matched it (RFC 4035, 3.1.3.2)
+ssize_t static dnshandle_nxdomain(dns_opt_t *opt, const dnssec_answers_t *sig, unsigned char *outbuf, unsigned char *outpos,
+                                  const unsigned char *outend, int zoneoff, const struct edns_t *edns) {
+  // the label right below the zone, lowercase
+  int pos = QNAME_OFFSET, last = QNAME_OFFSET;
+  while (pos < zoneoff) {
+    last = pos;
+    pos += 1 + outbuf[pos];
+  }
+  unsigned char label[64];
+  label[0] = outbuf[last];
+  for (int i = 1; i <= label[0]; i++)
+    label[i] = tolower(outbuf[last + i]);
+  // below one of our labels, the wildcard there is covered by its NSEC too
+  static const unsigned char star[2] = {1, '*'};
+  const dnssec_name_t *cover = dnssec_cover(sig, label);
+  const dnssec_name_t *wild = cover->label.size() == 1 + label[0] && !memcmp(&cover->label[0], label, 1 + label[0]) ? cover : dnssec_cover(sig, star);
+  unsigned char *start = outpos;
+  int nauth = sig->soa.nrr + cover->nsec.nrr + (wild != cover ? wild->nsec.nrr : 0);
+  if (dnssec_write(&outpos, outend, &sig->soa, zoneoff, NULL) ||
+      dnssec_write(&outpos, outend, &cover->nsec, zoneoff, cover->label.empty() ? NULL : &cover->label[0]) ||
+      (wild != cover && dnssec_write(&outpos, outend, &wild->nsec, zoneoff, wild->label.empty() ? NULL : &wild->label[0]))) {
+    // the proof comes whole or not at all: set TC
+    outpos = start;
+    nauth = 0;
+    outbuf[2] |= 2;
+  }
+  outbuf[8] = nauth >> 8;
+  outbuf[9] = nauth & 0xFF;
+  write_opt(&outpos, outend + opt_size(edns), opt->maxudp, 0, edns);
+  outbuf[11]++;
+  // set AA, NXDOMAIN
+  outbuf[2] |= 4;
+  outbuf[3] |= 3;
+  return outpos - outbuf;
+}
+
+// The current generation of signed answers, announced in our hazard slot
+// so that it is not freed while we copy from it
+static const dnssec_answers_t *dnssec_acquire(dns_opt_t *opt) {
+  const dnssec_answers_t *sig = opt->dnssec->load();
+  do {
+    opt->dnssecinuse.store(sig);
+    const dnssec_answers_t *now = opt->dnssec->load();
+    if (now == sig)
+      return sig;
+    sig = now;
+  } while (1);
+}
+
+// what dnshandle learned about a query, for the query log
+static void log_question(qlog_rec_t *rec, const unsigned char *name, int namelen, int ret, int label) {
+  rec->label = ret == 0 ? label : QLOG_LABEL_FOREIGN;
+  rec->namelen = namelen;
+  unsigned int h = 2166136261u;
+  for (int i = 0; i < namelen; i++)
+    h = (h ^ (unsigned char)tolower(name[i])) * 16777619u;
+  rec->qhash = h;
+  int len = name[0] < sizeof(rec->first) ? name[0] : sizeof(rec->first);
+  memset(rec->first, 0, sizeof(rec->first));
+  memcpy(rec->first, name + 1, len);
+}
+
+static void log_edns(qlog_rec_t *rec, const struct edns_t *edns) {
+  if (!edns->present)
+    return;
+  rec->flags |= QLOG_EDNS | (edns->cookie ? QLOG_COOKIE : 0) | (edns->flags & 0x8000 ? QLOG_DO : 0);
+  rec->udpsize = edns->udpsize;
+  if (edns->ecsfamily) {
+    rec->flags |= QLOG_ECS;
+    qlog_set_prefix(rec, edns->ecsfamily == 1 ? 4 : 6, edns->ecsaddr);
+  }
+}
+
+// addr is the client's address; outbuf must hold MAX_PAYLOAD bytes, or
+// MAX_TCP_PAYLOAD if tcp is set; rec, if not NULL, gets the question, and
+// reply what the reply bytes do not show
+ssize_t static dnshandle(dns_opt_t *opt, const struct sockaddr_in6 *addr, const unsigned char *inbuf, size_t insize, unsigned char* outbuf, int tcp, qlog_rec_t *rec, dns_reply_t *reply) {
   int error = 0;
+  reply->xrcode = 0;
+  reply->qtype = DNS_QT_NONE;
   if (insize < 12) // DNS header
     return -1;
   // copy id
@@ -278,8 +783,8 @@ ssize_t static dnshandle(dns_opt_t *opt, const unsigned char *inbuf, size_t insi
   outbuf[3] = inbuf[3];
   // clear error
   outbuf[3] &= ~15;
-  // check qr
-  if (inbuf[2] & 128) return set_error(outbuf, 1); /* printf("Got response?\n"); */
+  // check qr; never answer a response
+  if (inbuf[2] & 128) return -1; /* printf("Got response?\n"); */
   // check opcode
   if (((inbuf[2] & 120) >> 3) != 0) return set_error(outbuf, 1); /* printf("Opcode nonzero?\n"); */
   // unset TC
@@ -292,14 +797,52 @@ ssize_t static dnshandle(dns_opt_t *opt, const unsigned char *inbuf, size_t insi
   if (nquestion > 1) return set_error(outbuf, 4); /* printf("Multiple questions %i?\n", nquestion); */
   const unsigned char *inpos = inbuf + 12;
   const unsigned char *inend = inbuf + insize;
-  char name[256];
-  int offset = inpos - inbuf;
-  int ret = parse_name(&inpos, inend, inbuf, name, 256);
+  int label = DNS_LABEL_NONE;
+  int ret = parse_qname(opt, &inpos, inend, &label);
   if (ret == -1) return set_error(outbuf, 1);
   if (ret == -2) return set_error(outbuf, 5);
-  int namel = strlen(name), hostl = strlen(opt->host);
-  if (strcasecmp(name, opt->host) && (namel<hostl+2 || name[namel-hostl-1]!='.' || strcasecmp(name+namel-hostl,opt->host))) return set_error(outbuf, 5);
+  if (rec) log_question(rec, inbuf + 12, inpos - (inbuf + 12), ret, label);
   if (inend - inpos < 4) return set_error(outbuf, 1);
+  reply->qtype = qtype_index((inpos[0] << 8) + inpos[1]);
+  if (rec) rec->qtype = (inpos[0] << 8) + inpos[1];
+  struct edns_t edns;
+  if (parse_edns(inbuf, inpos + 4, inend, &edns)) return set_error(outbuf, 1);
+  if (rec) log_edns(rec, &edns);
+  if (edns.present && edns.version > 0) return set_error_edns(opt, outbuf, 16, &edns, reply); /* BADVERS */
+  // names in other zones are refused before any per-client work
+  if (ret == 1) return set_error_edns(opt, outbuf, 5, &edns, reply); /* not our zone */
+  // rate limiting comes first, as it is cheap; only a server cookie we
+  // issued, proving the client is not spoofed, lifts the limit
+  int limit = opt->rrl && !tcp ? rrl_check(opt->rrl, addr) : RRL_OK;
+  uint32_t now = edns.cookie ? time(NULL) : 0;
+  if (limit != RRL_OK && edns.cookie && cookie_valid(edns.cookie, edns.cookielen, addr, now))
+    limit = RRL_OK;
+  if (limit == RRL_DROP) {
+    opt->stats.dropped.inc();
+    return -1;
+  }
+  if (edns.cookie) {
+    cookie_make(edns.cookie, addr, now, edns.replycookie);
+    edns.replycookielen = COOKIE_CLIENT_LEN + COOKIE_SERVER_LEN;
+  }
+  if (limit == RRL_SLIP) {
+    opt->stats.slipped.inc();
+    // a client that speaks cookies gets a fresh one to retry with
+    if (edns.cookie) return set_error_edns(opt, outbuf, 23, &edns, reply); /* BADCOOKIE */
+    return dnsslip(inbuf, insize, outbuf);
+  }
+  // the region of the client subnet a resolver passed on, or else of the
+  // client itself; the reply says which prefix of the subnet it is for
+  int region = -1;
+  if (opt->regions && edns.ecsfamily) {
+    if (edns.ecssource > 0)
+      region = region_lookup(opt->regions, edns.ecsfamily == 1 ? 4 : 6, edns.ecsaddr, &edns.ecsscope);
+  } else if (opt->regions) {
+    if (IN6_IS_ADDR_V4MAPPED(&addr->sin6_addr))
+      region = region_lookup(opt->regions, 4, addr->sin6_addr.s6_addr + 12, NULL);
+    else
+      region = region_lookup(opt->regions, 6, addr->sin6_addr.s6_addr, NULL);
+  }
   // copy question to output
   memcpy(outbuf+12, inbuf+12, inpos+4 - (inbuf+12));
   // set counts
@@ -312,12 +855,55 @@ ssize_t static dnshandle(dns_opt_t *opt, const unsigned char *inbuf, size_t insi
   
   int typ = (inpos[0] << 8) + inpos[1];
   int cls = (inpos[2] << 8) + inpos[3];
+  int zoneoff = inpos - inbuf - opt->zonelen;
   inpos += 4;
   
   unsigned char *outpos = outbuf+(inpos-inbuf);
-  unsigned char *outend = outbuf + BUFLEN;
+  // without EDNS0, UDP replies are limited to 512 bytes; with it, to what
+  // the client advertised, capped at our configured maximum
+  int outsize = BUFLEN;
+  if (tcp)
+    outsize = MAX_TCP_PAYLOAD;
+  else if (edns.present && edns.udpsize > BUFLEN)
+    outsize = edns.udpsize < opt->maxudp ? edns.udpsize : opt->maxudp;
+  unsigned char *outend = outbuf + outsize;
+  // leave room for our own OPT record
+  if (edns.present)
+    outend -= opt_size(&edns);
+
+  // with DO, answers come signed in advance
+  const dnssec_answers_t *sig = NULL;
+  if (opt->dnssec && edns.present && (edns.flags & 0x8000) && (cls == CLASS_IN || cls == QCLASS_ANY))
+    sig = dnssec_acquire(opt);
+  if (sig && (label == DNS_LABEL_NONE || label == DNS_LABEL_APEX || label < (int)sig->labels.size())) {
+    edns.dnssecok = 1;
+    edns.ecsscope = 0; // the same answers for every client
+    if (label == DNS_LABEL_NONE)
+      return dnshandle_nxdomain(opt, sig, outbuf, outpos, outend, zoneoff, &edns);
+    return dnshandle_signed(opt, sig, label, typ, outbuf, outpos, outend, zoneoff, &edns);
+  }
   
 //   printf("DNS: Request host='%s' type=%i class=%i\n", name, typ, cls);
+
+  // a name in the zone that is no label of ours does not exist, with or
+  // without the DO bit
+  if (label == DNS_LABEL_NONE) {
+    unsigned char *soa = outpos;
+    if (!write_rendered(&outpos, outend, opt->soa_rr, opt->soa_rrlen)) {
+      // owned by the zone, not by the name asked for
+      soa[0] = 0xC0 | (zoneoff >> 8);
+      soa[1] = zoneoff & 0xFF;
+      outbuf[9]++;
+    }
+    if (edns.present) {
+      write_opt(&outpos, outend + opt_size(&edns), opt->maxudp, 0, &edns);
+      outbuf[11]++;
+    }
+    // set AA, NXDOMAIN
+    outbuf[2] |= 4;
+    outbuf[3] |= 3;
+    return outpos - outbuf;
+  }
   
   // calculate max size of authority section
   
@@ -325,15 +911,7 @@ ssize_t static dnshandle(dns_opt_t *opt, const unsigned char *inbuf, size_t insi
   
   if (!((typ == TYPE_NS || typ == QTYPE_ANY) && (cls == CLASS_IN || cls == QCLASS_ANY))) {
     // authority section will be necessary, either NS or SOA
-    unsigned char *newpos = outpos;
-    write_record_ns(&newpos, outend, "", offset, CLASS_IN, 0, opt->ns);
-    max_auth_size = newpos - outpos;
-
-    newpos = outpos;
-    write_record_soa(&newpos, outend, "", offset, CLASS_IN, opt->nsttl, opt->ns, opt->mbox, time(NULL), 604800, 86400, 2592000, 604800);
-    if (max_auth_size < newpos - outpos)
-        max_auth_size = newpos - outpos;
-//    printf("Authority section will claim %i bytes max\n", max_auth_size);
+    max_auth_size = opt->ns_rrlen > opt->soa_rrlen ? opt->ns_rrlen : opt->soa_rrlen;
   }
   
   // Answer section
@@ -342,55 +920,62 @@ ssize_t static dnshandle(dns_opt_t *opt, const unsigned char *inbuf, size_t insi
 
   // NS records
   if ((typ == TYPE_NS || typ == QTYPE_ANY) && (cls == CLASS_IN || cls == QCLASS_ANY)) {
-    int ret2 = write_record_ns(&outpos, outend - max_auth_size, "", offset, CLASS_IN, opt->nsttl, opt->ns);
-//    printf("wrote NS record: %i\n", ret2);
+    int ret2 = write_rendered(&outpos, outend - max_auth_size, opt->ns_rr, opt->ns_rrlen);
     if (!ret2) { outbuf[7]++; have_ns++; }
   }
 
   // SOA records
   if ((typ == TYPE_SOA || typ == QTYPE_ANY) && (cls == CLASS_IN || cls == QCLASS_ANY) && opt->mbox) {
-    int ret2 = write_record_soa(&outpos, outend - max_auth_size, "", offset, CLASS_IN, opt->nsttl, opt->ns, opt->mbox, time(NULL), 604800, 86400, 2592000, 604800);
-//    printf("wrote SOA record: %i\n", ret2);
+    int ret2 = write_rendered(&outpos, outend - max_auth_size, opt->soa_rr, opt->soa_rrlen);
     if (!ret2) { outbuf[7]++; }
   }
   
+  int nanswer = outbuf[7];
+
   // A/AAAA records
   if ((typ == TYPE_A || typ == TYPE_AAAA || typ == QTYPE_ANY) && (cls == CLASS_IN || cls == QCLASS_ANY)) {
-    addr_t addr[32];
-    int naddr = opt->cb((void*)opt, name, addr, 32, typ == TYPE_A || typ == QTYPE_ANY, typ == TYPE_AAAA || typ == QTYPE_ANY);
-    int n = 0;
-    while (n < naddr) {
-      int ret = 1;
-      if (addr[n].v == 4)
-         ret = write_record_a(&outpos, outend - max_auth_size, "", offset, CLASS_IN, opt->datattl, &addr[n]);
-      else if (addr[n].v == 6)
-         ret = write_record_aaaa(&outpos, outend - max_auth_size, "", offset, CLASS_IN, opt->datattl, &addr[n]);
-//      printf("wrote A record: %i\n", ret);
-      if (!ret) {
-        n++;
-        outbuf[7]++;
-      } else
+    // Ask for as many addresses as fit (A records take 16 bytes, AAAA 28),
+    // or for the configured answer count. Any that do not fit set TC.
+    const dns_rr_t *rr[MAX_TCP_PAYLOAD / 16];
+    int maxrr = (outend - max_auth_size - outpos) / (typ == TYPE_A ? 16 : 28);
+    if (opt->maxanswers > 0)
+      maxrr = opt->maxanswers;
+    if (maxrr > (int)(sizeof(rr) / sizeof(rr[0])))
+      maxrr = sizeof(rr) / sizeof(rr[0]);
+    int nrr = maxrr > 0 ? opt->cb((void*)opt, label, rr, maxrr, typ == TYPE_A || typ == QTYPE_ANY, typ == TYPE_AAAA || typ == QTYPE_ANY, region) : 0;
+    for (int n = 0; n < nrr; n++) {
+      if (write_rendered(&outpos, outend - max_auth_size, rr[n]->data, rr[n]->len)) {
+        // set TC
+        outbuf[2] |= 2;
         break;
+      }
+      nanswer++;
     }
+    outbuf[6] = nanswer >> 8;
+    outbuf[7] = nanswer & 0xFF;
   }
   
   // Authority section
-  if (!have_ns && outbuf[7]) {
-    int ret2 = write_record_ns(&outpos, outend, "", offset, CLASS_IN, opt->nsttl, opt->ns);
-//    printf("wrote NS record: %i\n", ret2);
+  if (!have_ns && nanswer) {
+    int ret2 = write_rendered(&outpos, outend, opt->ns_rr, opt->ns_rrlen);
     if (!ret2) {
       outbuf[9]++;
     }
   }
-  else if (!outbuf[7]) {
+  else if (!nanswer) {
     // Didn't include any answers, so reply with SOA as this is a negative
     // response. If we replied with NS above we'd create a bad horizontal
     // referral loop, as the NS response indicates where the resolver should
     // try next.
-    int ret2 = write_record_soa(&outpos, outend, "", offset, CLASS_IN, opt->nsttl, opt->ns, opt->mbox, time(NULL), 604800, 86400, 2592000, 604800);
-//    printf("wrote SOA record: %i\n", ret2);
+    int ret2 = write_rendered(&outpos, outend, opt->soa_rr, opt->soa_rrlen);
     if (!ret2) { outbuf[9]++; }
   }
+
+  // Additional section
+  if (edns.present) {
+    write_opt(&outpos, outend + opt_size(&edns), opt->maxudp, 0, &edns);
+    outbuf[11]++;
+  }
   
   // set AA
   outbuf[2] |= 4;
@@ -398,39 +983,373 @@ ssize_t static dnshandle(dns_opt_t *opt, const unsigned char *inbuf, size_t insi
   return outpos - outbuf;
 }
 
-static int listenSocket = -1;
+static void log_answer(qlog_ring_t *ring, qlog_rec_t *rec, int rcode, int answers) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  rec->time = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+  rec->rcode = rcode;
+  rec->answers = answers;
+  qlog_push(ring, rec);
+}
 
-int dnsserver(dns_opt_t *opt) {
-  struct sockaddr_in6 si_other;
-  int senderSocket = -1;
-  senderSocket = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
-  if (senderSocket == -1) 
-    return -3;
+// dnshandle, counted in opt->stats and logged to opt->qlog
+ssize_t static dnsanswer(dns_opt_t *opt, const struct sockaddr_in6 *addr, const unsigned char *inbuf, size_t insize, unsigned char* outbuf, int tcp) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  qlog_rec_t rec;
+  if (opt->qlog) {
+    memset(&rec, 0, sizeof(rec));
+    rec.label = QLOG_LABEL_FOREIGN;
+    rec.flags = tcp ? QLOG_TCP : 0;
+    if (IN6_IS_ADDR_V4MAPPED(&addr->sin6_addr))
+      qlog_set_prefix(&rec, 4, addr->sin6_addr.s6_addr + 12);
+    else
+      qlog_set_prefix(&rec, 6, addr->sin6_addr.s6_addr);
+  }
+  dns_reply_t reply;
+  ssize_t ret = dnshandle(opt, addr, inbuf, insize, outbuf, tcp, opt->qlog ? &rec : NULL, &reply);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  dns_stats_t *stats = &opt->stats;
+  stats->requests.inc();
+  uint64_t ns = (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+  int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+  stats->latency[bucket < DNS_LATENCY_MAX ? bucket : DNS_LATENCY_MAX - 1].inc();
+  stats->qtype[reply.qtype].inc();
+  if (ret < 12) {
+    stats->noreply.inc();
+    if (opt->qlog)
+      log_answer(opt->qlog, &rec, QLOG_NOREPLY, 0);
+    return ret;
+  }
+  int rcode = (reply.xrcode << 4) | (outbuf[3] & 15);
+  stats->rcode[rcode < DNS_RCODE_MAX ? rcode : DNS_RCODE_MAX - 1].inc();
+  if (outbuf[2] & 2)
+    stats->truncated.inc();
+  if (opt->qlog)
+    log_answer(opt->qlog, &rec, rcode, (outbuf[6] << 8) + outbuf[7]);
+  return ret;
+}
 
-  int replySocket;
-  if (listenSocket == -1) {
-    struct sockaddr_in6 si_me;
-    if ((listenSocket=socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP))==-1) {
-      listenSocket = -1;
-      return -1;
+// true if the datagram carried its destination address, so the reply can be
+// sent back from that same address (matters on multi-homed hosts)
+static bool has_dstaddr(struct msghdr *msg) {
+  for (struct cmsghdr *hdr = CMSG_FIRSTHDR(msg); hdr; hdr = CMSG_NXTHDR(msg, hdr)) {
+    if (hdr->cmsg_level == DSTADDR_LEVEL && hdr->cmsg_type == DSTADDR_SOCKOPT)
+      return true;
+  }
+  return false;
+}
+
+// Drain up to opt->batch datagrams per recvmmsg, answer all of them, and
+// flush the replies with a single sendmmsg.
+static int dnsserver_batch(dns_opt_t *opt, int sock) {
+  int batch = opt->batch > MAX_BATCH ? MAX_BATCH : opt->batch;
+  unsigned char (*inbuf)[BUFLEN] = (unsigned char (*)[BUFLEN])calloc(batch, BUFLEN);
+  unsigned char (*outbuf)[MAX_PAYLOAD] = (unsigned char (*)[MAX_PAYLOAD])calloc(batch, MAX_PAYLOAD);
+  struct sockaddr_in6 *si_other = (struct sockaddr_in6*)calloc(batch, sizeof(struct sockaddr_in6));
+  union control_data *cmsg = (union control_data*)calloc(batch, sizeof(union control_data));
+  struct iovec *iov_in = (struct iovec*)calloc(batch, sizeof(struct iovec));
+  struct iovec *iov_out = (struct iovec*)calloc(batch, sizeof(struct iovec));
+  struct mmsghdr *msg_in = (struct mmsghdr*)calloc(batch, sizeof(struct mmsghdr));
+  struct mmsghdr *msg_out = (struct mmsghdr*)calloc(batch, sizeof(struct mmsghdr));
+  if (!inbuf || !outbuf || !si_other || !cmsg || !iov_in || !iov_out || !msg_in || !msg_out)
+    return -4;
+  for (int i = 0; i < batch; i++) {
+    iov_in[i].iov_base = inbuf[i];
+    iov_in[i].iov_len = BUFLEN;
+    msg_in[i].msg_hdr.msg_name = &si_other[i];
+    msg_in[i].msg_hdr.msg_iov = &iov_in[i];
+    msg_in[i].msg_hdr.msg_iovlen = 1;
+    msg_in[i].msg_hdr.msg_control = &cmsg[i];
+  }
+  do {
+    // recvmmsg overwrites these with the actual lengths
+    for (int i = 0; i < batch; i++) {
+      msg_in[i].msg_hdr.msg_namelen = sizeof(si_other[i]);
+      msg_in[i].msg_hdr.msg_controllen = sizeof(cmsg[i]);
     }
-    replySocket = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
-    if (replySocket == -1)
-    {
-      close(listenSocket);
-      return -1;
+    int nin = recvmmsg(sock, msg_in, batch, MSG_WAITFORONE, NULL);
+    if (nin <= 0)
+      continue;
+    int nout = 0;
+    for (int i = 0; i < nin; i++) {
+      ssize_t insize = msg_in[i].msg_len;
+      if (insize <= 0)
+        continue;
+      ssize_t ret = dnsanswer(opt, &si_other[i], inbuf[i], insize, outbuf[i], 0);
+      if (ret <= 0)
+        continue;
+      struct msghdr *hdr = &msg_out[nout].msg_hdr;
+      iov_out[nout].iov_base = outbuf[i];
+      iov_out[nout].iov_len = ret;
+      hdr->msg_name = &si_other[i];
+      hdr->msg_namelen = msg_in[i].msg_hdr.msg_namelen;
+      hdr->msg_iov = &iov_out[nout];
+      hdr->msg_iovlen = 1;
+      if (has_dstaddr(&msg_in[i].msg_hdr)) {
+        hdr->msg_control = &cmsg[i];
+        hdr->msg_controllen = msg_in[i].msg_hdr.msg_controllen;
+      } else {
+        hdr->msg_control = NULL;
+        hdr->msg_controllen = 0;
+      }
+      nout++;
     }
-    int sockopt = 1;
-    setsockopt(listenSocket, IPPROTO_IPV6, DSTADDR_SOCKOPT, &sockopt, sizeof sockopt);
-    memset((char *) &si_me, 0, sizeof(si_me));
-    si_me.sin6_family = AF_INET6;
-    si_me.sin6_port = htons(opt->port);
-    si_me.sin6_addr = in6addr_any;
-    if (bind(listenSocket, (struct sockaddr*)&si_me, sizeof(si_me))==-1)
-      return -2;
+    int sent = 0;
+    while (sent < nout) {
+      int ret = sendmmsg(sock, msg_out + sent, nout - sent, 0);
+      // skip a datagram the kernel refused rather than retrying it forever
+      sent += ret > 0 ? ret : 1;
+    }
+  } while (!opt->quit.load(std::memory_order_relaxed));
+  return 0;
+}
+
+#if defined(__linux__)
+// One reply waiting for its sendmsg to complete
+struct uring_reply_t {
+  struct sockaddr_in6 addr;
+  struct iovec iov;
+  struct msghdr msg;
+  unsigned char outbuf[MAX_PAYLOAD];
+  union control_data cmsg; // last, it ends in a flexible array
+};
+
+#define URING_RECV ((uint64_t)-1)
+
+// Receive with one multishot recvmsg into kernel-picked buffers from a
+// registered buffer ring, and hand all replies produced by one pass over
+// the completion queue to the kernel with a single io_uring_enter.
+//  -1: io_uring is unavailable or lacks what we need; nothing was served
+static int dnsserver_uring(dns_opt_t *opt, int sock) {
+  int batch = opt->batch > MAX_BATCH ? MAX_BATCH : (opt->batch > 1 ? opt->batch : 32);
+  struct uring_t ring;
+  if (uring_init(&ring, 2 * batch) < 0)
+    return -1;
+  // each provided buffer holds the recvmsg header, the peer address, the
+  // control data and the request
+  struct msghdr recvmsg_tmpl;
+  memset(&recvmsg_tmpl, 0, sizeof(recvmsg_tmpl));
+  recvmsg_tmpl.msg_namelen = sizeof(struct sockaddr_in6);
+  recvmsg_tmpl.msg_controllen = sizeof(union control_data);
+  unsigned bufsize = sizeof(struct io_uring_recvmsg_out) + recvmsg_tmpl.msg_namelen + recvmsg_tmpl.msg_controllen + BUFLEN;
+  unsigned nbufs = 1;
+  while (nbufs < 8 * batch) nbufs <<= 1;
+  unsigned nreplies = 2 * ring.sq_entries;
+  unsigned char *bufs = (unsigned char*)malloc((size_t)nbufs * bufsize);
+  struct uring_reply_t *replies = (struct uring_reply_t*)calloc(nreplies, sizeof(struct uring_reply_t));
+  int *freelist = (int*)malloc(nreplies * sizeof(int));
+  if (!bufs || !replies || !freelist || uring_register_file(&ring, sock) < 0 || uring_register_buffers(&ring, 0, bufs, nbufs, bufsize) < 0) {
+    uring_exit(&ring);
+    free(bufs); free(replies); free(freelist);
+    return -1;
   }
-  
-  unsigned char inbuf[BUFLEN], outbuf[BUFLEN];
+  int nfree = 0;
+  for (int i = nreplies - 1; i >= 0; i--)
+    freelist[nfree++] = i;
+  bool armed = false, served = false;
+  do {
+    if (!armed) {
+      struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+      if (sqe) {
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->fd = 0;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->addr = (unsigned long)&recvmsg_tmpl;
+        sqe->len = 1;
+        sqe->buf_group = 0;
+        sqe->user_data = URING_RECV;
+        armed = true;
+      }
+    }
+    uring_submit_and_wait(&ring, 1);
+    unsigned nrecycled = 0;
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(&ring))) {
+      if (cqe->user_data != URING_RECV) {
+        freelist[nfree++] = cqe->user_data;
+        uring_cqe_seen(&ring);
+        continue;
+      }
+      if (!(cqe->flags & IORING_CQE_F_MORE))
+        armed = false;
+      if (cqe->res < 0) {
+        // ENOBUFS just means we fell behind; anything else on the first
+        // receive means this kernel cannot do multishot recvmsg
+        if (!served && cqe->res != -ENOBUFS) {
+          uring_exit(&ring);
+          free(bufs); free(replies); free(freelist);
+          return -1;
+        }
+        uring_cqe_seen(&ring);
+        continue;
+      }
+      served = true;
+      unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      unsigned char *buf = bufs + (size_t)bid * bufsize;
+      struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out*)buf;
+      unsigned char *name = buf + sizeof(*out);
+      unsigned char *control = name + recvmsg_tmpl.msg_namelen;
+      unsigned char *payload = control + recvmsg_tmpl.msg_controllen;
+      ssize_t insize = out->payloadlen > BUFLEN ? BUFLEN : out->payloadlen;
+      // with no free reply slot the request is dropped, as a full socket
+      // buffer would
+      if (nfree == 0) {
+        opt->stats.requests.inc();
+        opt->stats.noreply.inc();
+      } else if (insize > 0) {
+        struct uring_reply_t *reply = &replies[freelist[nfree - 1]];
+        memcpy(&reply->addr, name, sizeof(reply->addr));
+        ssize_t ret = dnsanswer(opt, &reply->addr, payload, insize, reply->outbuf, 0);
+        struct io_uring_sqe *sqe = NULL;
+        if (ret > 0 && !(sqe = uring_get_sqe(&ring))) {
+          // submission queue full: flush it and carry on
+          uring_submit_and_wait(&ring, 0);
+          sqe = uring_get_sqe(&ring);
+        }
+        if (sqe) {
+          int slot = freelist[--nfree];
+          reply->iov.iov_base = reply->outbuf;
+          reply->iov.iov_len = ret;
+          reply->msg.msg_name = &reply->addr;
+          reply->msg.msg_namelen = out->namelen > sizeof(reply->addr) ? sizeof(reply->addr) : out->namelen;
+          reply->msg.msg_iov = &reply->iov;
+          reply->msg.msg_iovlen = 1;
+          reply->msg.msg_control = NULL;
+          reply->msg.msg_controllen = 0;
+          if (out->controllen > 0 && out->controllen <= sizeof(reply->cmsg)) {
+            memcpy(&reply->cmsg, control, out->controllen);
+            reply->msg.msg_control = &reply->cmsg;
+            reply->msg.msg_controllen = out->controllen;
+            if (!has_dstaddr(&reply->msg)) {
+              reply->msg.msg_control = NULL;
+              reply->msg.msg_controllen = 0;
+            }
+          }
+          sqe->opcode = IORING_OP_SENDMSG;
+          sqe->fd = 0;
+          sqe->flags = IOSQE_FIXED_FILE;
+          sqe->addr = (unsigned long)&reply->msg;
+          sqe->len = 1;
+          sqe->user_data = slot;
+        } else if (ret > 0) {
+          // still no room: the answer is lost, like one the socket refused
+          opt->stats.noreply.inc();
+        }
+      }
+      uring_buffer_recycle(&ring, bufs, bufsize, bid, nrecycled++);
+      uring_cqe_seen(&ring);
+    }
+    if (nrecycled)
+      uring_buffers_advance(&ring, nrecycled);
+  } while (!opt->quit.load(std::memory_order_relaxed));
+  return 0;
+}
+#endif
+
+// Open a UDP socket bound to opt->port. SO_REUSEPORT lets every DNS
+// thread bind its own socket to the same port, and the kernel spreads
+// incoming datagrams over the group instead of queueing them all on one.
+int dnslisten(dns_opt_t *opt) {
+  int sock = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+  if (sock == -1)
+    return -1;
+  int sockopt = 1;
+  setsockopt(sock, DSTADDR_LEVEL, DSTADDR_RECVOPT, &sockopt, sizeof sockopt);
+#if defined(SO_REUSEPORT)
+  setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &sockopt, sizeof sockopt);
+#endif
+  struct sockaddr_in6 si_me;
+  memset((char *) &si_me, 0, sizeof(si_me));
+  si_me.sin6_family = AF_INET6;
+  si_me.sin6_port = htons(opt->port);
+  si_me.sin6_addr = in6addr_any;
+  if (bind(sock, (struct sockaddr*)&si_me, sizeof(si_me))==-1) {
+    close(sock);
+    return -2;
+  }
+  return sock;
+}
+
+// Steer each datagram to a socket by the CPU that received it: CPU
+// cpus[i] to socket i, and any other CPU c to socket c modulo nsockets
+// (all of them if ncpus is 0). Sockets join the SO_REUSEPORT group in bind
+// order, so socket i should be served by a thread on that CPU.
+int dnssteer(int sock, int nsockets, const int *cpus, int ncpus) {
+#if defined(SO_ATTACH_REUSEPORT_CBPF)
+  std::vector<struct sock_filter> code;
+  struct sock_filter load = { BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU) };
+  code.push_back(load);
+  for (int i = 0; i < ncpus; i++) {
+    // if A == cpus[i], return i, else go on to the next test
+    struct sock_filter test = { BPF_JMP | BPF_JEQ | BPF_K, 0, 1, (uint32_t)cpus[i] };
+    struct sock_filter ret = { BPF_RET | BPF_K, 0, 0, (uint32_t)i };
+    code.push_back(test);
+    code.push_back(ret);
+  }
+  struct sock_filter mod = { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)nsockets };
+  struct sock_filter ret = { BPF_RET | BPF_A, 0, 0, 0 };
+  code.push_back(mod);
+  code.push_back(ret);
+  struct sock_fprog prog = { (unsigned short)code.size(), &code[0] };
+  return setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+#else
+  return -1;
+#endif
+}
+
+// Have receives on sock poll the device queue for up to usecs before
+// sleeping, and keep the device interrupts off while they do (Linux
+// 5.11+), trading a CPU for lower latency. Raising the time needs
+// CAP_NET_ADMIN.
+int dnsbusypoll(int sock, int usecs) {
+#if defined(__linux__)
+# if !defined(SO_BUSY_POLL)
+#  define SO_BUSY_POLL 46
+# endif
+# if !defined(SO_PREFER_BUSY_POLL)
+#  define SO_PREFER_BUSY_POLL 69
+# endif
+  if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof usecs))
+    return -1;
+  // older kernels busy poll without it
+  int prefer = 1;
+  setsockopt(sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof prefer);
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+int dnsserver(dns_opt_t *opt) {
+  struct sockaddr_in6 si_other;
+  dns_prerender(opt);
+  int listenSocket = opt->sock;
+  if (listenSocket < 0) {
+    listenSocket = dnslisten(opt);
+    if (listenSocket < 0)
+      return listenSocket;
+    opt->sock = listenSocket;
+  }
+
+#if defined(__linux__)
+  // falls through to the portable loops on kernels without io_uring support
+  if (opt->uring && dnsserver_uring(opt, listenSocket) < 0) {
+    // one notice for all the DNS threads
+    static std::atomic<bool> fNoticed(false);
+    if (!fNoticed.exchange(true))
+      fprintf(stderr, "io_uring is unavailable, serving UDP DNS queries with %s instead.\n", opt->batch > 1 ? "recvmmsg" : "recvfrom");
+    opt->uring = 0;
+  }
+  if (opt->uring)
+    return 0;
+#endif
+
+  if (opt->batch > 1)
+    return dnsserver_batch(opt, listenSocket);
+
+  unsigned char inbuf[BUFLEN], outbuf[MAX_PAYLOAD];
   struct iovec iov[1] = {
     {
       .iov_base = inbuf,
@@ -446,33 +1365,244 @@ int dnsserver(dns_opt_t *opt) {
     .msg_control = &cmsg,
     .msg_controllen = sizeof(cmsg),
   };
-  for (; 1; ++(opt->nRequests))
+  while (!opt->quit.load(std::memory_order_relaxed))
   {
+    msg.msg_namelen = sizeof(si_other);
+    msg.msg_controllen = sizeof(cmsg);
     ssize_t insize = recvmsg(listenSocket, &msg, 0);
 //    unsigned char *addr = (unsigned char*)&si_other.sin_addr.s_addr;
-//    printf("DNS: Request %llu from %i.%i.%i.%i:%i of %i bytes\n", (unsigned long long)(opt->nRequests), addr[0], addr[1], addr[2], addr[3], ntohs(si_other.sin_port), (int)insize);
+//    printf("DNS: Request %llu from %i.%i.%i.%i:%i of %i bytes\n", (unsigned long long)(opt->stats.requests.get()), addr[0], addr[1], addr[2], addr[3], ntohs(si_other.sin_port), (int)insize);
     if (insize <= 0)
       continue;
 
-    ssize_t ret = dnshandle(opt, inbuf, insize, outbuf);
+    ssize_t ret = dnsanswer(opt, &si_other, inbuf, insize, outbuf, 0);
     if (ret <= 0)
       continue;
 
-    bool handled = false;
-    for (struct cmsghdr*hdr = CMSG_FIRSTHDR(&msg); hdr; hdr = CMSG_NXTHDR(&msg, hdr))
+    if (has_dstaddr(&msg))
     {
-      if (hdr->cmsg_level == IPPROTO_IP && hdr->cmsg_type == DSTADDR_SOCKOPT)
-      {
-        msg.msg_iov[0].iov_base = outbuf;
-        msg.msg_iov[0].iov_len = ret;
-        sendmsg(listenSocket, &msg, 0);
-        msg.msg_iov[0].iov_base = inbuf;
-        msg.msg_iov[0].iov_len = sizeof(inbuf);
-        handled = true;
-      }
+      msg.msg_iov[0].iov_base = outbuf;
+      msg.msg_iov[0].iov_len = ret;
+      sendmsg(listenSocket, &msg, 0);
+      msg.msg_iov[0].iov_base = inbuf;
+      msg.msg_iov[0].iov_len = sizeof(inbuf);
     }
-    if (!handled)
+    else
       sendto(listenSocket, outbuf, ret, 0, (struct sockaddr*)&si_other, sizeof(si_other));
   }
   return 0;
 }
+
+// Open a non-blocking TCP socket listening on opt->port.
+int dnslistentcp(dns_opt_t *opt) {
+  int sock = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+  if (sock == -1)
+    return -1;
+  int sockopt = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &sockopt, sizeof sockopt);
+  struct sockaddr_in6 si_me;
+  memset((char *) &si_me, 0, sizeof(si_me));
+  si_me.sin6_family = AF_INET6;
+  si_me.sin6_port = htons(opt->port);
+  si_me.sin6_addr = in6addr_any;
+  if (bind(sock, (struct sockaddr*)&si_me, sizeof(si_me))==-1 || listen(sock, 128)==-1) {
+    close(sock);
+    return -2;
+  }
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+  return sock;
+}
+
+// A DNS-over-TCP client connection. Requests are length-prefixed and may be
+// pipelined; they are answered in order. While a reply is still pending in
+// outbuf, no further requests are read from the connection.
+struct tcpconn_t {
+  int fd;
+  struct sockaddr_in6 addr;
+  time_t lastActive; // when the last request was answered
+  size_t inlen;
+  size_t skip; // bytes still to be discarded from the input
+  unsigned char inbuf[2 + BUFLEN];
+  unsigned char *outbuf;
+  size_t outlen, outsent;
+};
+
+static void tcp_close(int epfd, struct tcpconn_t **conns, int slot) {
+  struct tcpconn_t *conn = conns[slot];
+  epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  free(conn->outbuf);
+  free(conn);
+  conns[slot] = NULL;
+}
+
+//  0: ok
+// -1: connection failed
+static int tcp_flush(int epfd, struct tcpconn_t *conn, int slot) {
+  while (conn->outsent < conn->outlen) {
+    ssize_t ret = send(conn->fd, conn->outbuf + conn->outsent, conn->outlen - conn->outsent, MSG_NOSIGNAL);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (ret <= 0)
+      return -1;
+    conn->outsent += ret;
+  }
+  struct epoll_event ev;
+  ev.data.u32 = slot;
+  if (conn->outsent < conn->outlen) {
+    ev.events = EPOLLOUT;
+  } else {
+    conn->outlen = conn->outsent = 0;
+    ev.events = EPOLLIN;
+  }
+  epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+  return 0;
+}
+
+// answer the complete requests in conn->inbuf
+//  0: ok
+// -1: connection failed
+static int tcp_process(dns_opt_t *opt, int epfd, struct tcpconn_t *conn, int slot, unsigned char *outbuf, time_t now) {
+  while (conn->outlen == 0) {
+    if (conn->skip) {
+      size_t n = conn->skip < conn->inlen ? conn->skip : conn->inlen;
+      conn->inlen -= n;
+      conn->skip -= n;
+      memmove(conn->inbuf, conn->inbuf + n, conn->inlen);
+      if (conn->skip)
+        break;
+    }
+    if (conn->inlen < 2)
+      break;
+    size_t msglen = (conn->inbuf[0] << 8) + conn->inbuf[1];
+    // a request too long to buffer is answered from its header alone,
+    // which gets FORMERR, and the rest of it is discarded
+    size_t len = msglen > BUFLEN ? 12 : msglen;
+    if (conn->inlen < 2 + len)
+      break;
+    ssize_t ret = dnsanswer(opt, &conn->addr, conn->inbuf + 2, len, outbuf + 2, 1);
+    conn->skip = 2 + msglen;
+    if (ret <= 0)
+      continue;
+    conn->lastActive = now;
+    outbuf[0] = ret >> 8;
+    outbuf[1] = ret & 0xFF;
+    conn->outbuf = (unsigned char*)realloc(conn->outbuf, ret + 2);
+    if (!conn->outbuf)
+      return -1;
+    memcpy(conn->outbuf, outbuf, ret + 2);
+    conn->outlen = ret + 2;
+    conn->outsent = 0;
+    if (tcp_flush(epfd, conn, slot))
+      return -1;
+  }
+  return 0;
+}
+
+int dnstcpserver(dns_opt_t *opt) {
+  dns_prerender(opt);
+  int listenSocket = opt->sock;
+  if (listenSocket < 0) {
+    listenSocket = dnslistentcp(opt);
+    if (listenSocket < 0)
+      return listenSocket;
+    opt->sock = listenSocket;
+  }
+  int epfd = epoll_create1(0);
+  if (epfd == -1)
+    return -3;
+  struct tcpconn_t **conns = (struct tcpconn_t**)calloc(MAX_TCP_CONN, sizeof(struct tcpconn_t*));
+  unsigned char *outbuf = (unsigned char*)malloc(2 + MAX_TCP_PAYLOAD);
+  if (!conns || !outbuf) {
+    close(epfd);
+    free(conns);
+    free(outbuf);
+    return -4;
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.u32 = MAX_TCP_CONN; // marks the listening socket
+  epoll_ctl(epfd, EPOLL_CTL_ADD, listenSocket, &ev);
+  time_t lastSweep = time(NULL);
+  int draining = 0;
+  do {
+    // once told to quit, leave new connections to the listening socket's
+    // other owners, answer what the open ones sent, then close them
+    if (opt->quit && !draining) {
+      draining = 1;
+      epoll_ctl(epfd, EPOLL_CTL_DEL, listenSocket, NULL);
+    }
+    struct epoll_event events[64];
+    int nev = epoll_wait(epfd, events, 64, draining ? 10 : 1000);
+    time_t now = time(NULL);
+    for (int i = 0; i < nev; i++) {
+      int slot = events[i].data.u32;
+      if (slot == MAX_TCP_CONN) {
+        int fd;
+        struct sockaddr_in6 addr;
+        socklen_t addrlen = sizeof(addr);
+        while ((fd = accept4(listenSocket, (struct sockaddr*)&addr, &addrlen, SOCK_NONBLOCK)) >= 0) {
+          addrlen = sizeof(addr);
+          // so that one client cannot hold all the slots, a prefix (/24 or
+          // /56, as for rate limiting) may only hold a few of them
+          size_t prefixlen = IN6_IS_ADDR_V4MAPPED(&addr.sin6_addr) ? 15 : 7;
+          int free_slot = MAX_TCP_CONN, nprefix = 0;
+          for (int s = 0; s < MAX_TCP_CONN; s++) {
+            if (!conns[s]) {
+              if (free_slot == MAX_TCP_CONN) free_slot = s;
+            } else if (!memcmp(conns[s]->addr.sin6_addr.s6_addr, addr.sin6_addr.s6_addr, prefixlen)) {
+              nprefix++;
+            }
+          }
+          struct tcpconn_t *conn = free_slot < MAX_TCP_CONN && nprefix < MAX_TCP_PER_PREFIX ? (struct tcpconn_t*)calloc(1, sizeof(struct tcpconn_t)) : NULL;
+          if (!conn) {
+            close(fd);
+            continue;
+          }
+          conn->fd = fd;
+          conn->addr = addr;
+          conn->lastActive = now;
+          conns[free_slot] = conn;
+          ev.events = EPOLLIN;
+          ev.data.u32 = free_slot;
+          epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        }
+        continue;
+      }
+      struct tcpconn_t *conn = conns[slot];
+      if (!conn)
+        continue;
+      int failed = 0;
+      if (events[i].events & EPOLLOUT) {
+        failed = tcp_flush(epfd, conn, slot);
+      } else if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && conn->inlen < sizeof(conn->inbuf)) {
+        ssize_t ret = recv(conn->fd, conn->inbuf + conn->inlen, sizeof(conn->inbuf) - conn->inlen, 0);
+        if (ret > 0)
+          conn->inlen += ret;
+        else if (ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+          failed = 1;
+      }
+      if (!failed)
+        failed = tcp_process(opt, epfd, conn, slot, outbuf, now);
+      if (failed)
+        tcp_close(epfd, conns, slot);
+    }
+    // close connections that have been idle for too long, or when
+    // draining, as soon as they have nothing left to answer
+    if (now != lastSweep || draining) {
+      lastSweep = now;
+      int open = 0;
+      for (int slot = 0; slot < MAX_TCP_CONN; slot++) {
+        if (conns[slot] && (now - conns[slot]->lastActive > opt->tcpidle || (draining && !conns[slot]->inlen && !conns[slot]->outlen)))
+          tcp_close(epfd, conns, slot);
+        open += conns[slot] != NULL;
+      }
+      if (draining && !open)
+        break;
+    }
+  } while(1);
+  close(epfd);
+  free(conns);
+  free(outbuf);
+  return 0;
+}
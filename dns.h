@@ -2,6 +2,12 @@
 #define _DNS_H_ 1
 
 #include <stdint.h>
+#include <atomic>
+
+#include "rrl.h"
+#include "region.h"
+#include "qlog.h"
+#include "dnssec.h"
 
 struct addr_t {
     int v;
@@ -11,18 +17,112 @@ struct addr_t {
     } data;
 };
 
+// A or AAAA record rendered in wire format, ready to be copied into an
+// answer section
+struct dns_rr_t {
+    unsigned char v;
+    unsigned char len;
+    unsigned char data[28];
+};
+
+// Counter written by one thread and read by any: a relaxed load and store
+// instead of a locked read-modify-write, so counting costs no more than a
+// plain increment
+struct dns_counter_t {
+  std::atomic<uint64_t> v;
+  dns_counter_t() : v(0) {}
+  void inc() { v.store(v.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+  uint64_t get() const { return v.load(std::memory_order_relaxed); }
+};
+
+enum {
+  DNS_QT_A,
+  DNS_QT_NS,
+  DNS_QT_SOA,
+  DNS_QT_AAAA,
+  DNS_QT_ANY,
+  DNS_QT_OTHER,
+  DNS_QT_NONE, // no parsable question
+  DNS_QT_MAX
+};
+
+#define DNS_RCODE_MAX 24    // rcodes 0..23 (BADCOOKIE); higher ones count as 23
+#define DNS_LATENCY_MAX 32  // bucket i: dnshandle took [2^(i-1), 2^i) ns
+#define DNS_FILTER_MAX 32   // filter slots, numbered by the callback
+
+// Per-thread DNS metrics, padded to keep other threads' data off their
+// cache lines. Sum them over threads when reading.
+struct dns_stats_t {
+  unsigned char pad0[64];
+  dns_counter_t requests;
+  dns_counter_t dropped;   // replies dropped by rate limiting
+  dns_counter_t slipped;   // replies truncated by rate limiting
+  dns_counter_t noreply;   // requests not answered at all
+  dns_counter_t truncated; // replies with TC set
+  dns_counter_t qtype[DNS_QT_MAX];
+  dns_counter_t rcode[DNS_RCODE_MAX];
+  dns_counter_t filter[DNS_FILTER_MAX];
+  dns_counter_t latency[DNS_LATENCY_MAX];
+  unsigned char pad1[64];
+};
+
+// A label right below the zone, like "x9", that dnshandle recognizes and
+// hands to the callback as its id. Kept in a flat open-addressing table.
+struct dns_label_t {
+  unsigned char len; // 0 for a free slot
+  char label[63]; // lowercase
+  int id;
+};
+
+#define DNS_LABEL_APEX -1 // the query is for the zone itself
+#define DNS_LABEL_NONE -2 // a name in the zone that is no registered label
+
 struct dns_opt_t {
   int port;
+  int sock; // bound UDP socket, or -1 to let dnsserver open one
+  int batch; // datagrams per recvmmsg/sendmmsg; 1 disables batching
+  int uring; // serve UDP from an io_uring; cleared by dnsserver if the kernel cannot
+  int maxudp; // largest UDP reply to EDNS0 clients (512..4096)
+  int maxanswers; // addresses per answer, 0 for as many as fit; if they do not fit, TC is set
+  int tcpidle; // seconds before an idle TCP connection is closed
+  std::atomic<int> quit; // set by another thread to stop serving: UDP after the current batch, TCP once open connections are answered
+  rrl_t *rrl; // rate limiter for UDP replies, or NULL
+  const region_t *regions; // prefix to region table for EDNS Client Subnet, or NULL
+  qlog_ring_t *qlog; // query log ring of this thread, or NULL
+  std::atomic<const dnssec_answers_t*> *dnssec; // signed answers for queries with DO, or NULL not to sign
+  std::atomic<const dnssec_answers_t*> dnssecinuse; // hazard slot: the generation of *dnssec this thread may still read
+  unsigned int dnssecpick; // rotates through the signed answers
   int datattl;
   int nsttl;
   const char *host;
   const char *ns;
   const char *mbox;
-  int (*cb)(void *opt, char *requested_hostname, addr_t *addr, int max, int ipv4, int ipv6);
-  // stats
-  uint64_t nRequests;
+  // label: DNS_LABEL_APEX or the id of a label added by dns_add_label;
+  // region: of the client, see region_lookup, or -1
+  int (*cb)(void *opt, int label, const dns_rr_t **rr, int max, int ipv4, int ipv6, int region);
+  dns_label_t *labels; // labelmask + 1 slots, or NULL
+  unsigned int labelmask;
+  unsigned int nlabels;
+  // NS and SOA records, rendered by dns_prerender()
+  unsigned char ns_rr[512];
+  int ns_rrlen;
+  unsigned char soa_rr[512];
+  int soa_rrlen;
+  // host in lowercase wire format, also set by dns_prerender()
+  unsigned char zone[256];
+  int zonelen;
+  dns_stats_t stats;
 };
 
+int dnslisten(dns_opt_t *opt);
+int dnssteer(int sock, int nsockets, const int *cpus, int ncpus);
+int dnsbusypoll(int sock, int usecs);
 int dnsserver(dns_opt_t *opt);
+int dnslistentcp(dns_opt_t *opt);
+int dnstcpserver(dns_opt_t *opt);
+void dns_prerender(dns_opt_t *opt);
+int dns_render_addr(const dns_opt_t *opt, const addr_t *addr, dns_rr_t *rr);
+// label is matched case-insensitively; labels and labelmask start out NULL and 0
+void dns_add_label(dns_opt_t *opt, const char *label, int id);
 
 #endif
@@ -0,0 +1,507 @@
+// dnsbench: open-loop DNS load generator for testing a seeder locally.
+//
+// Queries are sent on a fixed schedule at the target rate, whether or not
+// earlier ones were answered, and latency is measured from the scheduled
+// send time, so a server that falls behind shows up as tail latency
+// instead of silently lowering the offered load.
+//
+// With -f, the queries of a seeder's query log (--qlog) are sent instead
+// of the synthetic mix, on the schedule they arrived in, or faster.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <atomic>
+#include <string>
+#include <algorithm>
+#include <vector>
+
+#include "qlog.h"
+
+#define MAX_QUERY 300
+#define SEND_BATCH 64
+#define IDS 65536
+
+struct QueryKind {
+  std::string name; // as given on the command line: A, AAAA, ANY, junk or x<flags>
+  int weight;
+  int qtype;
+  bool junk;
+  unsigned char wire[MAX_QUERY]; // rendered query, id left 0
+  int len;
+};
+
+struct BenchOpts {
+  const char *server;
+  int port;
+  const char *host;
+  double rate;
+  double duration;
+  int timeout; // ms
+  int edns;    // advertised UDP size, 0 for plain DNS
+  int nSockets;
+  std::vector<QueryKind> mix;
+  std::vector<qlog_rec_t> replay; // from -f, in time order
+  std::vector<uint64_t> replayAt; // send time of replay[i], in ns after the start
+};
+
+// one per source socket; ids are per socket, so each socket can have
+// IDS queries in flight
+struct BenchSocket {
+  int fd;
+  std::atomic<uint64_t> sched[IDS]; // scheduled send time in ns, 0 if not in flight
+  uint16_t nextId;
+};
+
+static std::atomic<bool> fDone(false);
+static std::atomic<uint64_t> nReplies(0), nTruncated(0), nErrors(0), nLate(0);
+static std::vector<std::atomic<uint64_t> > *latency; // histogram, one bucket per microsecond
+
+static uint64_t NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t rngState = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t Rand() {
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 7;
+  rngState ^= rngState << 17;
+  return rngState;
+}
+
+// render a query for name/qtype into buf, return its length or -1
+static int RenderQuery(unsigned char *buf, const std::string &name, int qtype, int edns) {
+  memset(buf, 0, 12);
+  buf[2] = 1; // rd, like a stub resolver would send
+  buf[5] = 1; // qdcount
+  buf[11] = edns ? 1 : 0;
+  int pos = 12;
+  size_t start = 0;
+  while (start < name.size()) {
+    size_t dot = name.find('.', start);
+    if (dot == std::string::npos) dot = name.size();
+    size_t len = dot - start;
+    if (len == 0 || len > 63 || pos + len + 1 > MAX_QUERY - 32)
+      return -1;
+    buf[pos++] = len;
+    memcpy(buf + pos, name.data() + start, len);
+    pos += len;
+    start = dot + 1;
+  }
+  buf[pos++] = 0;
+  buf[pos++] = qtype >> 8; buf[pos++] = qtype & 0xFF;
+  buf[pos++] = 0; buf[pos++] = 1;
+  if (edns) {
+    buf[pos++] = 0;
+    buf[pos++] = 0; buf[pos++] = 41;
+    buf[pos++] = edns >> 8; buf[pos++] = edns & 0xFF;
+    memset(buf + pos, 0, 6);
+    pos += 6;
+  }
+  return pos;
+}
+
+// parse "A=60,AAAA=20,ANY=5,x9=10,junk=5"
+static bool ParseMix(BenchOpts &opts, const char *spec) {
+  opts.mix.clear();
+  std::string s(spec);
+  size_t start = 0;
+  while (start < s.size()) {
+    size_t comma = s.find(',', start);
+    if (comma == std::string::npos) comma = s.size();
+    std::string item = s.substr(start, comma - start);
+    start = comma + 1;
+    QueryKind k;
+    size_t eq = item.find('=');
+    k.name = item.substr(0, eq);
+    k.weight = eq == std::string::npos ? 1 : atoi(item.c_str() + eq + 1);
+    k.junk = false;
+    k.qtype = 1;
+    if (k.name == "A") k.qtype = 1;
+    else if (k.name == "AAAA") k.qtype = 28;
+    else if (k.name == "ANY") k.qtype = 255;
+    else if (k.name == "junk") k.junk = true;
+    else if (k.name.size() < 2 || k.name[0] != 'x') {
+      fprintf(stderr, "Unknown query kind '%s'\n", k.name.c_str());
+      return false;
+    }
+    if (k.weight <= 0)
+      continue;
+    opts.mix.push_back(k);
+  }
+  return !opts.mix.empty();
+}
+
+// a query for a random name: half under the seed's zone, half outside it
+static int RenderJunk(unsigned char *buf, const BenchOpts &opts) {
+  static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789-";
+  uint64_t r = Rand();
+  std::string label;
+  int n = 3 + r % 20;
+  for (int i = 0; i < n; i++)
+    label += chars[Rand() % 36];
+  std::string name = label + "." + ((r >> 8) & 1 ? opts.host : "invalid");
+  return RenderQuery(buf, name, (r >> 9) & 1 ? 1 : 28, opts.edns);
+}
+
+static bool RecTimeLess(const qlog_rec_t &a, const qlog_rec_t &b) {
+  return a.time < b.time;
+}
+
+// read a query log, and space its queries out as they arrived, speed times
+// faster; stop after duration seconds of it if duration is positive
+static bool LoadReplay(BenchOpts &opts, const char *path, double speed, double duration) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "Cannot open query log %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  qlog_header_t header;
+  if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, QLOG_MAGIC, sizeof(header.magic)) || header.recsize != sizeof(qlog_rec_t)) {
+    fprintf(stderr, "%s is not a query log of this version\n", path);
+    fclose(f);
+    return false;
+  }
+  qlog_rec_t rec;
+  while (fread(&rec, sizeof(rec), 1, f) == 1)
+    opts.replay.push_back(rec);
+  fclose(f);
+  if (opts.replay.empty()) {
+    fprintf(stderr, "%s holds no queries\n", path);
+    return false;
+  }
+  // the writer drains one thread at a time
+  std::stable_sort(opts.replay.begin(), opts.replay.end(), RecTimeLess);
+  uint64_t first = opts.replay[0].time;
+  for (size_t i = 0; i < opts.replay.size(); i++) {
+    uint64_t at = (opts.replay[i].time - first) * 1000 / speed;
+    if (duration > 0 && at >= duration * 1e9) {
+      opts.replay.resize(i);
+      break;
+    }
+    opts.replayAt.push_back(at);
+  }
+  return true;
+}
+
+// a query like the logged one: same name as far as the log tells it, same
+// type, EDNS0 size, DO bit and client subnet, but always over UDP
+static int RenderReplay(unsigned char *buf, const BenchOpts &opts, const qlog_rec_t &rec) {
+  std::string first(rec.first, strnlen(rec.first, sizeof(rec.first)));
+  std::string name;
+  if (rec.label == -1) // the apex
+    name = opts.host;
+  else if (rec.label == QLOG_LABEL_FOREIGN)
+    name = first.empty() ? "invalid" : first + ".invalid";
+  else
+    name = (first.empty() ? "x" : first) + "." + opts.host;
+  int edns = rec.flags & QLOG_EDNS ? (rec.udpsize ? rec.udpsize : 512) : 0;
+  int len = RenderQuery(buf, name, rec.qtype, edns);
+  if (len >= 0 && edns && (rec.flags & QLOG_DO))
+    buf[len - 4] |= 0x80;
+  if (len < 0 || !(rec.flags & QLOG_ECS) || !rec.family)
+    return len;
+  // the logged prefix as an EDNS Client Subnet option
+  int source = rec.family == 4 ? 24 : 48;
+  int bytes = source / 8;
+  unsigned char *opt = buf + len;
+  opt[0] = 0; opt[1] = 8;
+  opt[2] = 0; opt[3] = 4 + bytes;
+  opt[4] = 0; opt[5] = rec.family == 4 ? 1 : 2;
+  opt[6] = source; opt[7] = 0;
+  memcpy(opt + 8, rec.prefix, bytes);
+  buf[len - 1] = 8 + bytes; // OPT rdlength
+  return len + 8 + bytes;
+}
+
+extern "C" void *ThreadReceive(void *arg) {
+  std::vector<BenchSocket*> &socks = *(std::vector<BenchSocket*>*)arg;
+  std::vector<struct pollfd> pfd(socks.size());
+  for (size_t i = 0; i < socks.size(); i++) {
+    pfd[i].fd = socks[i]->fd;
+    pfd[i].events = POLLIN;
+  }
+  static unsigned char bufs[SEND_BATCH][4096];
+  struct mmsghdr msgs[SEND_BATCH];
+  struct iovec iov[SEND_BATCH];
+  size_t nBuckets = latency->size();
+  while (!fDone) {
+    if (poll(&pfd[0], pfd.size(), 50) <= 0)
+      continue;
+    for (size_t s = 0; s < socks.size(); s++) {
+      if (!(pfd[s].revents & POLLIN))
+        continue;
+      int n;
+      do {
+        for (int i = 0; i < SEND_BATCH; i++) {
+          iov[i].iov_base = bufs[i];
+          iov[i].iov_len = sizeof(bufs[i]);
+          memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+          msgs[i].msg_hdr.msg_iov = &iov[i];
+          msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        n = recvmmsg(socks[s]->fd, msgs, SEND_BATCH, MSG_DONTWAIT, NULL);
+        uint64_t now = NowNs();
+        for (int i = 0; i < n; i++) {
+          if (msgs[i].msg_len < 12)
+            continue;
+          const unsigned char *b = bufs[i];
+          uint64_t sched = socks[s]->sched[(b[0] << 8) | b[1]].exchange(0);
+          if (!sched)
+            continue; // duplicate, or answered after the timeout
+          uint64_t us = (now - sched) / 1000;
+          if (us >= nBuckets) {
+            nLate++;
+            continue;
+          }
+          (*latency)[us]++;
+          nReplies++;
+          if (b[2] & 2) nTruncated++;
+          if (b[3] & 15) nErrors++;
+        }
+      } while (n == SEND_BATCH);
+    }
+  }
+  return NULL;
+}
+
+static uint64_t Percentile(double q, uint64_t total) {
+  uint64_t seen = 0;
+  for (size_t i = 0; i < latency->size(); i++) {
+    seen += (*latency)[i];
+    if (seen >= q * total)
+      return i;
+  }
+  return latency->size();
+}
+
+static const char *help = "dnsbench\n"
+                          "Usage: %s -h <host> [options]\n"
+                          "\n"
+                          "Options:\n"
+                          "-h <host>       Seed host name to query\n"
+                          "-s <ip>         Server address (default 127.0.0.1)\n"
+                          "-p <port>       Server UDP port (default 53)\n"
+                          "-r <qps>        Target query rate (default 10000)\n"
+                          "-d <seconds>    Duration (default 10)\n"
+                          "-m <mix>        Query mix as kind=weight,...; kinds: A, AAAA, ANY, junk, x<flags>\n"
+                          "                (default A=60,AAAA=20,ANY=5,x9=10,junk=5)\n"
+                          "-t <ms>         Count replies later than this as lost (default 1000)\n"
+                          "-e <bytes>      Send EDNS0 with this UDP size (default 0 = plain DNS)\n"
+                          "-c <n>          Source sockets (default 4)\n"
+                          "-f <file>       Replay the queries of a seeder query log (--qlog) instead of -r and -m;\n"
+                          "                -d then limits how much of it to replay (default: all of it)\n"
+                          "-x <factor>     Replay that many times faster than the queries arrived (default 1)\n"
+                          "-?, --help      Show this text\n"
+                          "\n";
+
+int main(int argc, char **argv) {
+  BenchOpts opts;
+  opts.server = "127.0.0.1";
+  opts.port = 53;
+  opts.host = NULL;
+  opts.rate = 10000;
+  opts.duration = 10;
+  opts.timeout = 1000;
+  opts.edns = 0;
+  opts.nSockets = 4;
+  const char *mix = "A=60,AAAA=20,ANY=5,x9=10,junk=5";
+  const char *replayFile = NULL;
+  double speed = 1;
+  bool fDuration = false;
+  static struct option long_options[] = {
+    {"help", no_argument, 0, '?'},
+    {0, 0, 0, 0}
+  };
+  int c;
+  while ((c = getopt_long(argc, argv, "h:s:p:r:d:m:t:e:c:f:x:?", long_options, NULL)) != -1) {
+    switch (c) {
+      case 'h': opts.host = optarg; break;
+      case 's': opts.server = optarg; break;
+      case 'p': opts.port = atoi(optarg); break;
+      case 'r': opts.rate = atof(optarg); break;
+      case 'd': opts.duration = atof(optarg); fDuration = true; break;
+      case 'm': mix = optarg; break;
+      case 't': opts.timeout = atoi(optarg); break;
+      case 'e': opts.edns = atoi(optarg); break;
+      case 'c': opts.nSockets = atoi(optarg); break;
+      case 'f': replayFile = optarg; break;
+      case 'x': speed = atof(optarg); break;
+      default:
+        fprintf(stderr, help, argv[0]);
+        return 1;
+    }
+  }
+  if (!opts.host || opts.rate <= 0 || opts.duration <= 0 || opts.timeout <= 0 || opts.nSockets < 1 || speed <= 0 || !ParseMix(opts, mix)) {
+    fprintf(stderr, help, argv[0]);
+    return 1;
+  }
+  if (replayFile) {
+    if (!LoadReplay(opts, replayFile, speed, fDuration ? opts.duration : 0))
+      return 1;
+    printf("replaying %llu queries over %.2fs\n", (unsigned long long)opts.replay.size(), opts.replayAt.back() / 1e9);
+  }
+  int totalWeight = 0;
+  for (size_t i = 0; i < opts.mix.size(); i++) {
+    QueryKind &k = opts.mix[i];
+    totalWeight += k.weight;
+    if (k.junk)
+      continue;
+    std::string name = k.name[0] == 'x' ? k.name + "." + opts.host : std::string(opts.host);
+    k.len = RenderQuery(k.wire, name, k.qtype, opts.edns);
+    if (k.len < 0) {
+      fprintf(stderr, "Bad host name '%s'\n", name.c_str());
+      return 1;
+    }
+  }
+
+  struct sockaddr_storage server;
+  socklen_t serverlen;
+  memset(&server, 0, sizeof(server));
+  struct sockaddr_in *sin = (struct sockaddr_in*)&server;
+  struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)&server;
+  if (inet_pton(AF_INET, opts.server, &sin->sin_addr) == 1) {
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(opts.port);
+    serverlen = sizeof(*sin);
+  } else if (inet_pton(AF_INET6, opts.server, &sin6->sin6_addr) == 1) {
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(opts.port);
+    serverlen = sizeof(*sin6);
+  } else {
+    fprintf(stderr, "Bad server address '%s'\n", opts.server);
+    return 1;
+  }
+  std::vector<BenchSocket*> socks;
+  for (int i = 0; i < opts.nSockets; i++) {
+    BenchSocket *s = new BenchSocket;
+    s->fd = socket(server.ss_family, SOCK_DGRAM, 0);
+    int bufsize = 1 << 22;
+    setsockopt(s->fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    setsockopt(s->fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+    if (s->fd < 0 || connect(s->fd, (struct sockaddr*)&server, serverlen) < 0) {
+      fprintf(stderr, "Unable to connect to %s port %i: %s\n", opts.server, opts.port, strerror(errno));
+      return 1;
+    }
+    fcntl(s->fd, F_SETFL, O_NONBLOCK);
+    for (int j = 0; j < IDS; j++)
+      s->sched[j] = 0;
+    s->nextId = 0;
+    socks.push_back(s);
+  }
+  latency = new std::vector<std::atomic<uint64_t> >(opts.timeout * 1000);
+  for (size_t i = 0; i < latency->size(); i++)
+    (*latency)[i] = 0;
+  rngState ^= NowNs();
+
+  pthread_t receiver;
+  pthread_create(&receiver, NULL, ThreadReceive, &socks);
+
+  uint64_t nSent = 0, nSendFailed = 0, nCollisions = 0;
+  uint64_t total = opts.replay.empty() ? opts.rate * opts.duration : opts.replay.size();
+  double interval = 1e9 / opts.rate;
+  uint64_t start = NowNs();
+  static unsigned char bufs[SEND_BATCH][MAX_QUERY];
+  struct mmsghdr msgs[SEND_BATCH];
+  struct iovec iov[SEND_BATCH];
+  size_t sockIdx = 0;
+  while (nSent < total) {
+    uint64_t now = NowNs();
+    uint64_t due;
+    if (opts.replay.empty()) {
+      due = (now - start) / interval + 1;
+    } else {
+      due = nSent;
+      while (due < total && opts.replayAt[due] <= now - start) due++;
+    }
+    if (due > total) due = total;
+    if (due <= nSent) {
+      uint64_t next = start + (opts.replay.empty() ? nSent * interval : opts.replayAt[nSent]);
+      if (next > now + 20000) {
+        // a replay can pause for longer than a second
+        uint64_t wait = next - now - 10000;
+        struct timespec ts = {(time_t)(wait / 1000000000), (long)(wait % 1000000000)};
+        nanosleep(&ts, NULL);
+      }
+      continue;
+    }
+    // send everything that is due, round robin over the sockets
+    BenchSocket *s = socks[sockIdx++ % socks.size()];
+    int n = due - nSent > SEND_BATCH ? SEND_BATCH : due - nSent;
+    for (int i = 0; i < n; i++) {
+      int len;
+      if (!opts.replay.empty()) {
+        len = RenderReplay(bufs[i], opts, opts.replay[nSent + i]);
+        if (len < 0) len = RenderQuery(bufs[i], opts.host, 1, 0);
+      } else {
+        int pick = Rand() % totalWeight;
+        size_t k = 0;
+        while (pick >= opts.mix[k].weight) pick -= opts.mix[k++].weight;
+        if (opts.mix[k].junk) {
+          len = RenderJunk(bufs[i], opts);
+        } else {
+          len = opts.mix[k].len;
+          memcpy(bufs[i], opts.mix[k].wire, len);
+        }
+      }
+      uint16_t id = s->nextId++;
+      bufs[i][0] = id >> 8;
+      bufs[i][1] = id & 0xFF;
+      // the reply to a query for this id never came; it is counted lost
+      if (s->sched[id].exchange(start + (opts.replay.empty() ? (nSent + i) * interval : opts.replayAt[nSent + i])))
+        nCollisions++;
+      iov[i].iov_base = bufs[i];
+      iov[i].iov_len = len;
+      memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int sent = 0;
+    while (sent < n) {
+      int ret = sendmmsg(s->fd, msgs + sent, n - sent, 0);
+      if (ret <= 0) {
+        // a full send buffer means the generator cannot keep up; the
+        // query is lost, not retried later
+        s->sched[(bufs[sent][0] << 8) | bufs[sent][1]] = 0;
+        nSendFailed++;
+        ret = 1;
+      }
+      sent += ret;
+    }
+    nSent += n;
+  }
+  uint64_t sendEnd = NowNs();
+  // wait for the stragglers
+  struct timespec ts = {opts.timeout / 1000, (opts.timeout % 1000) * 1000000L};
+  nanosleep(&ts, NULL);
+  fDone = true;
+  pthread_join(receiver, NULL);
+
+  double secs = (sendEnd - start) / 1e9;
+  uint64_t replies = nReplies;
+  if (opts.replay.empty())
+    printf("sent %llu queries in %.2fs (%.0f qps offered, target %.0f)\n", (unsigned long long)nSent, secs, nSent / secs, opts.rate);
+  else
+    printf("sent %llu queries in %.2fs (%.0f qps offered, replayed at %gx)\n", (unsigned long long)nSent, secs, nSent / secs, speed);
+  printf("replies %llu (%.0f qps), lost %llu (%.2f%%), late %llu, send failures %llu\n", (unsigned long long)replies, replies / secs, (unsigned long long)(nSent - replies), nSent ? 100.0 * (nSent - replies) / nSent : 0.0, (unsigned long long)nLate, (unsigned long long)nSendFailed);
+  printf("truncated %llu, error rcodes %llu\n", (unsigned long long)nTruncated, (unsigned long long)nErrors);
+  if (nCollisions)
+    printf("warning: %llu query ids reused while still in flight; use more sockets (-c)\n", (unsigned long long)nCollisions);
+  if (replies)
+    printf("latency p50 %lluus p99 %lluus p999 %lluus\n", (unsigned long long)Percentile(0.5, replies), (unsigned long long)Percentile(0.99, replies), (unsigned long long)Percentile(0.999, replies));
+  return 0;
+}
@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/evp.h>
+#include <openssl/obj_mac.h>
+#include <openssl/pem.h>
+#include <openssl/sha.h>
+
+#include "dnssec.h"
+
+#define CLASS_IN 1
+
+struct dnssec_key_t {
+  EVP_PKEY *pkey;
+  unsigned char pub[64]; // x and y of the public point
+  std::vector<unsigned char> dnskey;
+  int tag;
+};
+
+static bool is_p256(EVP_PKEY *pkey) {
+  if (EVP_PKEY_base_id(pkey) != EVP_PKEY_EC)
+    return false;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  char group[64];
+  return EVP_PKEY_get_group_name(pkey, group, sizeof(group), NULL) && !strcmp(group, "prime256v1");
+#else
+  const EC_KEY *ec = EVP_PKEY_get0_EC_KEY(pkey);
+  return ec && EC_GROUP_get_curve_name(EC_KEY_get0_group(ec)) == NID_X9_62_prime256v1;
+#endif
+}
+
+// RFC 4034, appendix B
+static int key_tag(const std::vector<unsigned char> &rdata) {
+  uint32_t ac = 0;
+  for (size_t i = 0; i < rdata.size(); i++)
+    ac += (i & 1) ? rdata[i] : rdata[i] << 8;
+  ac += (ac >> 16) & 0xFFFF;
+  return ac & 0xFFFF;
+}
+
+dnssec_key_t *dnssec_load_key(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    fprintf(stderr, "Cannot open DNSSEC key %s\n", path);
+    return NULL;
+  }
+  EVP_PKEY *pkey = PEM_read_PrivateKey(f, NULL, NULL, NULL);
+  fclose(f);
+  unsigned char point[65], *p = point;
+  if (!pkey || !is_p256(pkey) || i2d_PublicKey(pkey, NULL) != sizeof(point) || i2d_PublicKey(pkey, &p) != sizeof(point) || point[0] != 4) {
+    fprintf(stderr, "%s holds no ECDSA P-256 private key\n", path);
+    if (pkey)
+      EVP_PKEY_free(pkey);
+    return NULL;
+  }
+  dnssec_key_t *key = new dnssec_key_t;
+  key->pkey = pkey;
+  memcpy(key->pub, point + 1, sizeof(key->pub));
+  unsigned char head[4] = {1, 1, 3, DNSSEC_ALGORITHM}; // flags 257, protocol 3
+  key->dnskey.assign(head, head + 4);
+  key->dnskey.insert(key->dnskey.end(), key->pub, key->pub + sizeof(key->pub));
+  key->tag = key_tag(key->dnskey);
+  return key;
+}
+
+int dnssec_key_tag(const dnssec_key_t *key) {
+  return key->tag;
+}
+
+std::vector<unsigned char> dnssec_dnskey(const dnssec_key_t *key) {
+  return key->dnskey;
+}
+
+std::vector<unsigned char> dnssec_ds(const dnssec_key_t *key, const unsigned char *zone, int zonelen) {
+  std::vector<unsigned char> data(zone, zone + zonelen);
+  data.insert(data.end(), key->dnskey.begin(), key->dnskey.end());
+  std::vector<unsigned char> ds(4 + SHA256_DIGEST_LENGTH);
+  ds[0] = key->tag >> 8;
+  ds[1] = key->tag & 0xFF;
+  ds[2] = DNSSEC_ALGORITHM;
+  ds[3] = 2; // SHA-256
+  SHA256(&data[0], data.size(), &ds[4]);
+  return ds;
+}
+
+static void put16(std::vector<unsigned char> &v, int x) {
+  v.push_back(x >> 8);
+  v.push_back(x & 0xFF);
+}
+
+static void put32(std::vector<unsigned char> &v, uint32_t x) {
+  put16(v, x >> 16);
+  put16(v, x & 0xFFFF);
+}
+
+static int count_labels(const unsigned char *name) {
+  int n = 0;
+  while (*name) {
+    n++;
+    name += *name + 1;
+  }
+  return n;
+}
+
+// the fixed 64-byte r|s form of an ECDSA P-256 signature (RFC 6605)
+static bool sign_data(const dnssec_key_t *key, const std::vector<unsigned char> &data, unsigned char *sig) {
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  unsigned char der[80];
+  size_t derlen = sizeof(der);
+  bool ok = ctx && EVP_DigestSignInit(ctx, NULL, EVP_sha256(), NULL, key->pkey) == 1 && EVP_DigestSign(ctx, der, &derlen, &data[0], data.size()) == 1;
+  if (ctx)
+    EVP_MD_CTX_free(ctx);
+  if (!ok)
+    return false;
+  const unsigned char *p = der;
+  ECDSA_SIG *ecsig = d2i_ECDSA_SIG(NULL, &p, derlen);
+  if (!ecsig)
+    return false;
+  const BIGNUM *r, *s;
+  ECDSA_SIG_get0(ecsig, &r, &s);
+  ok = BN_bn2binpad(r, sig, 32) == 32 && BN_bn2binpad(s, sig + 32, 32) == 32;
+  ECDSA_SIG_free(ecsig);
+  return ok;
+}
+
+bool dnssec_sign(const dnssec_key_t *key, const unsigned char *zone, int zonelen, const unsigned char *owner, int ownerlen, int type, uint32_t ttl,
+                 const std::vector<std::vector<unsigned char> > &rdata, uint32_t inception, uint32_t expiration, dnssec_rrset_t *out) {
+  out->data.clear();
+  out->nrr = 0;
+  if (rdata.empty())
+    return true;
+  // RRSIG rdata up to the signature
+  std::vector<unsigned char> rrsig;
+  put16(rrsig, type);
+  rrsig.push_back(DNSSEC_ALGORITHM);
+  rrsig.push_back(count_labels(owner));
+  put32(rrsig, ttl);
+  put32(rrsig, expiration);
+  put32(rrsig, inception);
+  put16(rrsig, key->tag);
+  rrsig.insert(rrsig.end(), zone, zone + zonelen);
+  // signed data: that, then the records in canonical order (RFC 4034, 6.3)
+  std::vector<std::vector<unsigned char> > sorted(rdata);
+  std::sort(sorted.begin(), sorted.end());
+  std::vector<unsigned char> data(rrsig);
+  for (size_t i = 0; i < sorted.size(); i++) {
+    data.insert(data.end(), owner, owner + ownerlen);
+    put16(data, type);
+    put16(data, CLASS_IN);
+    put32(data, ttl);
+    put16(data, sorted[i].size());
+    data.insert(data.end(), sorted[i].begin(), sorted[i].end());
+  }
+  unsigned char sig[64];
+  if (!sign_data(key, data, sig))
+    return false;
+  rrsig.insert(rrsig.end(), sig, sig + sizeof(sig));
+  // the records in the order given, then the RRSIG
+  for (size_t i = 0; i <= rdata.size(); i++) {
+    const std::vector<unsigned char> &rd = i < rdata.size() ? rdata[i] : rrsig;
+    put16(out->data, 0xC000);
+    put16(out->data, i < rdata.size() ? type : DNSSEC_TYPE_RRSIG);
+    put16(out->data, CLASS_IN);
+    put32(out->data, ttl);
+    put16(out->data, rd.size());
+    out->data.insert(out->data.end(), rd.begin(), rd.end());
+  }
+  out->nrr = rdata.size() + 1;
+  return true;
+}
+
+std::vector<unsigned char> dnssec_nsec(const unsigned char *next, int nextlen, std::vector<int> types) {
+  std::vector<unsigned char> rdata(next, next + nextlen);
+  // type bitmap, one window per 256 types (RFC 4034, 4.1.2)
+  std::sort(types.begin(), types.end());
+  for (size_t i = 0; i < types.size();) {
+    int window = types[i] >> 8;
+    unsigned char bits[32] = {};
+    int len = 0;
+    for (; i < types.size() && types[i] >> 8 == window; i++) {
+      int b = types[i] & 0xFF;
+      bits[b / 8] |= 0x80 >> (b % 8);
+      len = b / 8 + 1;
+    }
+    rdata.push_back(window);
+    rdata.push_back(len);
+    rdata.insert(rdata.end(), bits, bits + len);
+  }
+  return rdata;
+}
+
+int dnssec_write(unsigned char **outpos, const unsigned char *outend, const dnssec_rrset_t *rrset, int offset, const unsigned char *label) {
+  size_t len = rrset->data.size();
+  if (len == 0)
+    return 0;
+  if (label) {
+    // owners that are not in the reply yet: the label, then the pointer
+    int labellen = 1 + label[0];
+    if (outend - *outpos < (ptrdiff_t)(len + rrset->nrr * labellen))
+      return -2;
+    unsigned char *out = *outpos;
+    for (size_t pos = 0; pos < len;) {
+      size_t rrlen = 12 + ((rrset->data[pos + 10] << 8) | rrset->data[pos + 11]);
+      memcpy(out, label, labellen);
+      out += labellen;
+      *out++ = 0xC0 | (offset >> 8);
+      *out++ = offset & 0xFF;
+      memcpy(out, &rrset->data[pos + 2], rrlen - 2);
+      out += rrlen - 2;
+      pos += rrlen;
+    }
+    *outpos = out;
+    return 0;
+  }
+  if (outend - *outpos < (ptrdiff_t)len)
+    return -2;
+  unsigned char *out = *outpos;
+  memcpy(out, &rrset->data[0], len);
+  // owner, type, class, ttl, rdlength, rdata
+  for (size_t pos = 0; pos < len; pos += 12 + ((out[pos + 10] << 8) | out[pos + 11])) {
+    out[pos] = 0xC0 | (offset >> 8);
+    out[pos + 1] = offset & 0xFF;
+  }
+  *outpos += len;
+  return 0;
+}
+
+int dnssec_write_rrsig(unsigned char **outpos, const unsigned char *outend, const dnssec_rrset_t *rrset, int offset) {
+  size_t len = rrset->data.size();
+  if (len == 0)
+    return 0;
+  // the RRSIG comes after the records it signs
+  size_t pos = 0;
+  for (int i = 1; i < rrset->nrr; i++)
+    pos += 12 + ((rrset->data[pos + 10] << 8) | rrset->data[pos + 11]);
+  if (outend - *outpos < (ptrdiff_t)(len - pos))
+    return -2;
+  memcpy(*outpos, &rrset->data[pos], len - pos);
+  (*outpos)[0] = 0xC0 | (offset >> 8);
+  (*outpos)[1] = offset & 0xFF;
+  *outpos += len - pos;
+  return 0;
+}
+
+const dnssec_name_t *dnssec_cover(const dnssec_answers_t *answers, const unsigned char *label) {
+  // few names: one per filter
+  const dnssec_name_t *cover = &answers->apex;
+  for (size_t i = 0; i < answers->order.size(); i++) {
+    const std::vector<unsigned char> &l = answers->labels[answers->order[i]].label;
+    if (std::lexicographical_compare(label + 1, label + 1 + label[0], l.begin() + 1, l.end()))
+      break;
+    cover = &answers->labels[answers->order[i]];
+  }
+  return cover;
+}
@@ -0,0 +1,91 @@
+#ifndef _DNSSEC_H_
+#define _DNSSEC_H_ 1
+
+#include <stdint.h>
+#include <vector>
+
+// Online DNSSEC signing with a single ECDSA P-256 key (algorithm 13),
+// serving as both key and zone signing key. A signature costs tens of
+// microseconds, far more than answering, so replies are not signed one
+// by one: a background thread signs a bounded set of answers whenever
+// the good set changes, and the DNS threads copy one of them into each
+// reply to a query with the DO bit.
+
+#define DNSSEC_ALGORITHM 13 // ECDSA P-256 with SHA-256
+
+// record types of signed answers
+enum {
+  DNSSEC_TYPE_A = 1,
+  DNSSEC_TYPE_NS = 2,
+  DNSSEC_TYPE_SOA = 6,
+  DNSSEC_TYPE_AAAA = 28,
+  DNSSEC_TYPE_RRSIG = 46,
+  DNSSEC_TYPE_NSEC = 47,
+  DNSSEC_TYPE_DNSKEY = 48
+};
+
+struct dnssec_key_t;
+
+// NULL, after printing why, if path holds no PEM ECDSA P-256 private key
+dnssec_key_t *dnssec_load_key(const char *path);
+
+int dnssec_key_tag(const dnssec_key_t *key);
+
+// DNSKEY rdata: flags 257 (zone key, SEP), protocol 3, algorithm 13 and
+// the public key
+std::vector<unsigned char> dnssec_dnskey(const dnssec_key_t *key);
+
+// DS rdata with a SHA-256 digest, for the key at zone (lowercase wire format)
+std::vector<unsigned char> dnssec_ds(const dnssec_key_t *key, const unsigned char *zone, int zonelen);
+
+// An RRset and its RRSIG, rendered for a reply except for the owner
+// names: each record starts with a 2-byte compression pointer that
+// dnssec_write points at the owner's place in that reply.
+struct dnssec_rrset_t {
+  std::vector<unsigned char> data;
+  int nrr; // records, counting the RRSIG; 0 for none
+  dnssec_rrset_t() : nrr(0) {}
+};
+
+// Sign records of type with rdata (distinct, in any order, names in them lowercase)
+// at owner, a name in zone, both in lowercase wire format. The signature
+// is valid from inception to expiration. false if signing failed.
+bool dnssec_sign(const dnssec_key_t *key, const unsigned char *zone, int zonelen, const unsigned char *owner, int ownerlen, int type, uint32_t ttl,
+                 const std::vector<std::vector<unsigned char> > &rdata, uint32_t inception, uint32_t expiration, dnssec_rrset_t *out);
+
+// NSEC rdata listing types, with next (lowercase wire format) as the next
+// name in the chain: it proves which types its owner has, and that no
+// name exists between the two
+std::vector<unsigned char> dnssec_nsec(const unsigned char *next, int nextlen, std::vector<int> types);
+
+// Copy rrset into a reply at *outpos, with its owner names pointing to
+// offset, or if label (length first) is not NULL, made of label and a
+// pointer to offset; -2 if it does not fit
+int dnssec_write(unsigned char **outpos, const unsigned char *outend, const dnssec_rrset_t *rrset, int offset, const unsigned char *label);
+
+// Copy only the RRSIG of rrset, with its owner name pointing to offset;
+// -2 if it does not fit
+int dnssec_write_rrsig(unsigned char **outpos, const unsigned char *outend, const dnssec_rrset_t *rrset, int offset);
+
+// Signed answers for the apex or a label below it
+struct dnssec_name_t {
+  std::vector<unsigned char> label; // lowercase, length first; empty at the apex
+  std::vector<dnssec_rrset_t> a, aaaa; // alternative answers to pick from
+  dnssec_rrset_t nsec; // to the next name: for no data, or no such name
+};
+
+// One generation of signed answers: built by one thread, then only read,
+// and replaced as a whole. Readers announce the generation they use in a
+// hazard slot, and the builder frees a replaced one once no slot names it.
+struct dnssec_answers_t {
+  dnssec_rrset_t ns, soa, dnskey; // at the apex
+  dnssec_name_t apex;
+  std::vector<dnssec_name_t> labels; // by label id
+  std::vector<int> order; // label ids in canonical order (RFC 4034, 6.1), after the apex
+};
+
+// The name whose NSEC covers label (lowercase, length first) below the zone,
+// and every name below it; that label's own name if it has one
+const dnssec_name_t *dnssec_cover(const dnssec_answers_t *answers, const unsigned char *label);
+
+#endif
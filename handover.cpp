@@ -0,0 +1,180 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "handover.h"
+
+#define HANDOVER_MAGIC "DNSHAND1"
+#define HANDOVER_ACK 'S'
+
+// sent along with the descriptors; the data follows on the stream
+struct handover_header_t {
+  char magic[8];
+  uint32_t nudp;
+  uint32_t ntcp;
+  uint64_t datalen;
+};
+
+static int unix_addr(const char *path, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path))
+    return -1;
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+int handover_listen(const char *path) {
+  struct sockaddr_un addr;
+  if (unix_addr(path, &addr))
+    return -1;
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0)
+    return -1;
+  unlink(path);
+  if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) || listen(sock, 1)) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+int handover_connect(const char *path) {
+  struct sockaddr_un addr;
+  if (unix_addr(path, &addr))
+    return -1;
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0)
+    return -1;
+  if (connect(sock, (struct sockaddr*)&addr, sizeof(addr))) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+int handover_accept(int sock) {
+  int conn;
+  do {
+    conn = accept(sock, NULL, NULL);
+  } while (conn < 0 && errno == EINTR);
+  return conn;
+}
+
+static int write_all(int conn, const char *buf, size_t len) {
+  while (len) {
+    ssize_t n = write(conn, buf, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int read_all(int conn, char *buf, size_t len) {
+  while (len) {
+    ssize_t n = read(conn, buf, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int handover_send(int conn, const int *fds, int nudp, int ntcp, const std::string &data) {
+  int nfds = nudp + ntcp;
+  if (nfds < 1 || nfds > HANDOVER_MAX_FDS)
+    return -1;
+  handover_header_t header;
+  memcpy(header.magic, HANDOVER_MAGIC, sizeof(header.magic));
+  header.nudp = nudp;
+  header.ntcp = ntcp;
+  header.datalen = data.size();
+  struct iovec iov = { &header, sizeof(header) };
+  char control[CMSG_SPACE(HANDOVER_MAX_FDS * sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+  ssize_t n;
+  do {
+    n = sendmsg(conn, &msg, 0);
+  } while (n < 0 && errno == EINTR);
+  if (n != sizeof(header))
+    return -1;
+  return write_all(conn, data.data(), data.size());
+}
+
+int handover_recv(int conn, std::vector<int> &udp, std::vector<int> &tcp, std::string &data) {
+  handover_header_t header;
+  struct iovec iov = { &header, sizeof(header) };
+  char control[CMSG_SPACE(HANDOVER_MAX_FDS * sizeof(int))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t n;
+  do {
+    n = recvmsg(conn, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+  } while (n < 0 && errno == EINTR);
+  std::vector<int> fds;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      const int *p = (const int*)CMSG_DATA(cmsg);
+      fds.insert(fds.end(), p, p + count);
+    }
+  }
+  if (n != sizeof(header) || memcmp(header.magic, HANDOVER_MAGIC, sizeof(header.magic)) || (msg.msg_flags & MSG_CTRUNC) || fds.size() != header.nudp + header.ntcp) {
+    for (size_t i = 0; i < fds.size(); i++)
+      close(fds[i]);
+    return -1;
+  }
+  udp.assign(fds.begin(), fds.begin() + header.nudp);
+  tcp.assign(fds.begin() + header.nudp, fds.end());
+  data.resize(header.datalen);
+  if (header.datalen && read_all(conn, &data[0], header.datalen)) {
+    for (size_t i = 0; i < fds.size(); i++)
+      close(fds[i]);
+    udp.clear();
+    tcp.clear();
+    return -1;
+  }
+  return 0;
+}
+
+int handover_ack(int conn) {
+  char ack = HANDOVER_ACK;
+  return write_all(conn, &ack, 1);
+}
+
+int handover_wait_ack(int conn, int timeout) {
+  struct pollfd pfd = { conn, POLLIN, 0 };
+  if (poll(&pfd, 1, timeout * 1000) != 1)
+    return -1;
+  char ack;
+  if (read_all(conn, &ack, 1) || ack != HANDOVER_ACK)
+    return -1;
+  return 0;
+}
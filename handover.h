@@ -0,0 +1,45 @@
+#ifndef _HANDOVER_H_
+#define _HANDOVER_H_ 1
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+// Handing the bound DNS sockets and the node database from a running
+// seeder to the one replacing it, over a Unix socket, so that no query
+// goes unanswered during a restart:
+//
+//   new                                  old
+//   handover_connect(path)       --->    handover_accept()
+//                                <---    handover_send(sockets, database)
+//   handover_recv()
+//   start serving on the sockets
+//   handover_ack()               --->    handover_wait_ack(), then exit
+//
+// The old seeder keeps serving on its copies of the sockets until the ack,
+// and if the new one dies before sending it, simply goes on.
+
+#define HANDOVER_MAX_FDS 250
+
+// listening socket at path, replacing a stale one; -1 on error
+int handover_listen(const char *path);
+
+// connection to the seeder listening at path, or -1 if there is none
+int handover_connect(const char *path);
+
+// the next connection on a handover_listen socket, or -1
+int handover_accept(int sock);
+
+// send nudp UDP sockets followed by ntcp TCP sockets, and data; 0 on success
+int handover_send(int conn, const int *fds, int nudp, int ntcp, const std::string &data);
+
+// receive what handover_send sent; 0 on success
+int handover_recv(int conn, std::vector<int> &udp, std::vector<int> &tcp, std::string &data);
+
+// tell the old seeder we are serving; 0 on success
+int handover_ack(int conn);
+
+// wait up to timeout seconds for the ack; 0 if it came
+int handover_wait_ack(int conn, int timeout);
+
+#endif
@@ -7,6 +7,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <atomic>
 
 #include "bitcoin.h"
@@ -21,23 +24,70 @@ const char* dnsseeder_version = "0.1.1.1.b\0x0";
 
 bool fTestNet = false;
 
+// parse a CPU list like "2,3,8-11" into cpus
+static bool ParseCpuList(const char *list, std::vector<int> &cpus) {
+  cpus.clear();
+  const char *p = list;
+  while (*p) {
+    char *end;
+    long first = strtol(p, &end, 10), last = first;
+    if (end == p) return false;
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p) return false;
+    }
+    if (first < 0 || last < first || last >= CPU_SETSIZE) return false;
+    for (long cpu = first; cpu <= last; cpu++)
+      cpus.push_back(cpu);
+    p = end;
+    if (*p == ',') p++;
+    else if (*p) return false;
+  }
+  return !cpus.empty();
+}
+
 class CDnsSeedOpts {
 public:
   int nThreads;
   int nPort;
   int nDnsThreads;
+  int nBatch;
+  int nMaxUdp;
+  int nMaxAnswers;
+  int nRrlRate;
+  int nRrlBurst;
+  int nRrlSlip;
+  int nWeightMode;
+  int nGroupCap;
+  int nMinTtl;
+  int nMaxTtl;
+  int nQlogSize;
+  int nQlogFiles;
+  int nBusyPoll;
+  int nSigBundles;
   int fUseTestNet;
   int fWipeBan;
   int fWipeIgnore;
+  int fSteerCpu;
+  int fNoTcp;
+  int fUring;
+  int fFastFirst;
   const char *mbox;
   const char *ns;
   const char *host;
   const char *tor;
+  const char *regionFile;
+  const char *qlogFile;
+  const char *metricsFile;
+  const char *handoverPath;
+  const char *dnskeyFile;
   const char *ipv4_proxy;
   const char *ipv6_proxy;
   std::set<uint64_t> filter_whitelist;
+  std::vector<int> dnsCpus; // low-latency mode: CPUs reserved for the DNS threads
 
-  CDnsSeedOpts() : nThreads(96), nDnsThreads(4), nPort(53), mbox(NULL), ns(NULL), host(NULL), tor(NULL), fUseTestNet(false), fWipeBan(false), fWipeIgnore(false), ipv4_proxy(NULL), ipv6_proxy(NULL) {}
+  CDnsSeedOpts() : nThreads(96), nDnsThreads(4), nBatch(32), nMaxUdp(1232), nMaxAnswers(0), nRrlRate(0), nRrlBurst(0), nRrlSlip(2), nWeightMode(WEIGHT_UPTIME), nGroupCap(1), nMinTtl(600), nMaxTtl(14400), nQlogSize(64), nQlogFiles(4), nBusyPoll(50), nSigBundles(16), nPort(53), mbox(NULL), ns(NULL), host(NULL), tor(NULL), regionFile(NULL), qlogFile(NULL), metricsFile(NULL), handoverPath(NULL), dnskeyFile(NULL), fUseTestNet(false), fWipeBan(false), fWipeIgnore(false), fSteerCpu(false), fNoTcp(false), fUring(false), fFastFirst(false), ipv4_proxy(NULL), ipv6_proxy(NULL) {}
 
   void ParseCommandLine(int argc, char **argv) {
     static const char *help = "Bitmark-seeder\n"
@@ -50,6 +100,22 @@ public:
                               "-t <threads>    Number of crawlers to run in parallel (default 96)\n"
                               "-d <threads>    Number of DNS server threads (default 4)\n"
                               "-p <port>       UDP port to listen on (default 53)\n"
+                              "-b <n>          Datagrams per DNS receive/send syscall (default 32, 1 disables)\n"
+                              "-e <bytes>      Largest UDP reply to EDNS0 clients (default 1232)\n"
+                              "-a <n>          Addresses per DNS answer, truncating if they do not fit (default: as many as fit)\n"
+                              "-r <n>          Rate limit UDP replies per client /24 or /56 to n per second (default 0 = off)\n"
+                              "--rrlburst <n>  Replies a client prefix may burst above the rate limit (default: the rate)\n"
+                              "--rrlslip <n>   Send every n-th rate limited reply truncated instead of dropping it (default 2)\n"
+                              "--minttl <s>    Shortest TTL of answers, used while the good set changes quickly (default 600)\n"
+                              "--maxttl <s>    Longest TTL of answers, used while the good set is stable (default 14400)\n"
+                              "--regions <f>   Prefer nodes in the client's region, with regions by prefix from file f\n"
+                              "--weight <w>    Favour nodes in answers by: uniform, uptime, recent, both or latency (default uptime)\n"
+                              "--groupcap <n>  Addresses per network group in an answer while other groups are left, 0 for no limit (default 1)\n"
+                              "--qlog <f>      Log every DNS query in binary to file f, for replay with dnsbench -f\n"
+                              "--qlogsize <n>  Start a new query log after n MB, keeping the old one as f.1 (default 64)\n"
+                              "--qlogfiles <n> Query log files to keep, counting the current one (default 4)\n"
+                              "--dnskey <f>    Sign answers with DNSSEC, with the PEM ECDSA P-256 private key in file f\n"
+                              "--sigbundles <n> Signed answers to rotate through per name and address family (default 16)\n"
                               "-o <ip:port>    Tor proxy IP/Port\n"
                               "-i <ip:port>    IPV4 SOCKS5 proxy IP/Port\n"
                               "-k <ip:port>    IPV6 SOCKS5 proxy IP/Port\n"
@@ -57,6 +123,16 @@ public:
                               "--testnet       Use testnet\n"
                               "--wipeban       Wipe list of banned nodes\n"
                               "--wipeignore    Wipe list of ignored nodes\n"
+                              "--steercpu      Steer DNS queries to the thread pinned to the receiving CPU\n"
+                              "--dnscpus <l>   Low-latency mode: pin DNS threads to the CPUs in list l (like 2,3,8-11),\n"
+                              "                keep all other threads off them, busy poll and lock memory\n"
+                              "--busypoll <us> In low-latency mode, busy poll UDP sockets for up to us microseconds (default 50, 0 = off)\n"
+                              "--notcp         Do not answer DNS queries over TCP\n"
+                              "--handover <f>  Take over the DNS sockets and nodes of a seeder listening on Unix socket f,\n"
+                              "                then listen there to hand them over to the next one in turn\n"
+                              "--uring         Serve UDP DNS queries through io_uring, if the kernel supports it (Linux 6.0+)\n"
+                              "--fastfirst     List the addresses in an answer by handshake time, fastest first\n"
+                              "--metrics <f>   Write the DNS server's counters to file f every second\n"
                               "-?, --help      Show this text\n"
                               "\n";
     bool showHelp = false;
@@ -69,6 +145,26 @@ public:
         {"threads", required_argument, 0, 't'},
         {"dnsthreads", required_argument, 0, 'd'},
         {"port", required_argument, 0, 'p'},
+        {"batch", required_argument, 0, 'b'},
+        {"ednsmax", required_argument, 0, 'e'},
+        {"answers", required_argument, 0, 'a'},
+        {"rrl", required_argument, 0, 'r'},
+        {"rrlburst", required_argument, 0, 'B'},
+        {"rrlslip", required_argument, 0, 'S'},
+        {"regions", required_argument, 0, 'R'},
+        {"minttl", required_argument, 0, 'L'},
+        {"maxttl", required_argument, 0, 'M'},
+        {"weight", required_argument, 0, 'W'},
+        {"groupcap", required_argument, 0, 'G'},
+        {"dnscpus", required_argument, 0, 'C'},
+        {"busypoll", required_argument, 0, 'P'},
+        {"qlog", required_argument, 0, 'Q'},
+        {"metrics", required_argument, 0, 'T'},
+        {"handover", required_argument, 0, 'O'},
+        {"qlogsize", required_argument, 0, 'Z'},
+        {"qlogfiles", required_argument, 0, 'F'},
+        {"dnskey", required_argument, 0, 'K'},
+        {"sigbundles", required_argument, 0, 'N'},
         {"onion", required_argument, 0, 'o'},
         {"proxyipv4", required_argument, 0, 'i'},
         {"proxyipv6", required_argument, 0, 'k'},
@@ -76,11 +172,15 @@ public:
         {"testnet", no_argument, &fUseTestNet, 1},
         {"wipeban", no_argument, &fWipeBan, 1},
         {"wipeignore", no_argument, &fWipeBan, 1},
+        {"steercpu", no_argument, &fSteerCpu, 1},
+        {"notcp", no_argument, &fNoTcp, 1},
+        {"uring", no_argument, &fUring, 1},
+        {"fastfirst", no_argument, &fFastFirst, 1},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
       };
       int option_index = 0;
-      int c = getopt_long(argc, argv, "h:n:m:t:p:d:o:i:k:w:", long_options, &option_index);
+      int c = getopt_long(argc, argv, "h:n:m:t:p:d:b:e:a:r:o:i:k:w:", long_options, &option_index);
       if (c == -1) break;
       switch (c) {
         case 'h': {
@@ -116,6 +216,124 @@ public:
           break;
         }
 
+        case 'b': {
+          int n = strtol(optarg, NULL, 10);
+          if (n > 0 && n <= 1024) nBatch = n;
+          break;
+        }
+
+        case 'e': {
+          int n = strtol(optarg, NULL, 10);
+          if (n >= 512 && n <= 4096) nMaxUdp = n;
+          break;
+        }
+
+        case 'a': {
+          int n = strtol(optarg, NULL, 10);
+          if (n >= 0 && n < 65535 / 16) nMaxAnswers = n; // as many as fit in TCP
+          break;
+        }
+
+        case 'r': {
+          int n = strtol(optarg, NULL, 10);
+          if (n >= 0 && n <= 100000) nRrlRate = n;
+          break;
+        }
+
+        case 'G': {
+          int n = strtol(optarg, NULL, 10);
+          if (n >= 0 && n <= 4096) nGroupCap = n;
+          break;
+        }
+
+        case 'W': {
+          if (!strcmp(optarg, "uniform")) nWeightMode = WEIGHT_UNIFORM;
+          else if (!strcmp(optarg, "uptime")) nWeightMode = WEIGHT_UPTIME;
+          else if (!strcmp(optarg, "recent")) nWeightMode = WEIGHT_RECENT;
+          else if (!strcmp(optarg, "both")) nWeightMode = WEIGHT_BOTH;
+          else if (!strcmp(optarg, "latency")) nWeightMode = WEIGHT_LATENCY;
+          else showHelp = true;
+          break;
+        }
+
+        case 'B': {
+          int n = strtol(optarg, NULL, 10);
+          if (n > 0 && n <= 4000) nRrlBurst = n;
+          break;
+        }
+
+        case 'S': {
+          int n = strtol(optarg, NULL, 10);
+          if (n >= 0 && n <= 100) nRrlSlip = n;
+          break;
+        }
+
+        case 'L': {
+          int n = strtol(optarg, NULL, 10);
+          if (n >= 1 && n <= 604800) nMinTtl = n;
+          break;
+        }
+
+        case 'M': {
+          int n = strtol(optarg, NULL, 10);
+          if (n >= 1 && n <= 604800) nMaxTtl = n;
+          break;
+        }
+
+        case 'R': {
+          regionFile = optarg;
+          break;
+        }
+
+        case 'C': {
+          if (!ParseCpuList(optarg, dnsCpus)) showHelp = true;
+          break;
+        }
+
+        case 'P': {
+          int n = strtol(optarg, NULL, 10);
+          if (n >= 0 && n <= 100000) nBusyPoll = n;
+          break;
+        }
+
+        case 'O': {
+          handoverPath = optarg;
+          break;
+        }
+
+        case 'Q': {
+          qlogFile = optarg;
+          break;
+        }
+
+        case 'T': {
+          metricsFile = optarg;
+          break;
+        }
+
+        case 'Z': {
+          int n = strtol(optarg, NULL, 10);
+          if (n >= 1 && n <= 65536) nQlogSize = n;
+          break;
+        }
+
+        case 'F': {
+          int n = strtol(optarg, NULL, 10);
+          if (n >= 1 && n <= 1000) nQlogFiles = n;
+          break;
+        }
+
+        case 'K': {
+          dnskeyFile = optarg;
+          break;
+        }
+
+        case 'N': {
+          int n = strtol(optarg, NULL, 10);
+          if (n >= 1 && n <= 1024) nSigBundles = n;
+          break;
+        }
+
         case 'o': {
           tor = optarg;
           break;
@@ -164,13 +382,24 @@ public:
         filter_whitelist.insert(NODE_NETWORK_LIMITED | NODE_WITNESS | NODE_BLOOM);
     }
     if (host != NULL && ns == NULL) showHelp = true;
+    if (nMaxTtl < nMinTtl) nMaxTtl = nMinTtl;
     if (showHelp) fprintf(stderr, help, argv[0]);
   }
 };
 
 #include "dns.h"
+#include "cookie.h"
+#include "handover.h"
 
 CAddrDb db;
+region_t *regions = NULL; // from --regions
+qlog_t *qlog = NULL; // from --qlog
+const char *metricsFile = NULL; // from --metrics
+dnssec_key_t *dnssecKey = NULL; // from --dnskey
+int nSigBundles; // from --sigbundles
+std::atomic<const dnssec_answers_t*> signedAnswers(NULL); // the latest generation, from before the DNS threads start
+int64_t nStartMs; // GetTimeMillis() at startup
+std::atomic<int64_t> nFirstAnswerMs(0); // GetTimeMillis() when the first address was served, or 0
 
 extern "C" void* ThreadCrawler(void* data) {
   int *nThreads=(int*)data;
@@ -181,7 +410,7 @@ extern "C" void* ThreadCrawler(void* data) {
     int64 now = time(NULL);
     if (ips.empty()) {
       wait *= 1000;
-      wait += rand() % (500 * *nThreads);
+      wait += GetFastRandRange(500 * *nThreads);
       Sleep(wait);
       continue;
     }
@@ -193,8 +422,10 @@ extern "C" void* ThreadCrawler(void* data) {
       res.nHeight = 0;
       res.strClientV = "";
       res.services = 0;
+      res.nConnectMs = -1;
+      res.nHandshakeMs = -1;
       bool getaddr = res.ourLastSuccess + 86400 < now;
-      res.fGood = TestNode(res.service,res.nBanTime,res.nClientV,res.strClientV,res.nHeight,getaddr ? &addr : NULL, res.services);
+      res.fGood = TestNode(res.service,res.nBanTime,res.nClientV,res.strClientV,res.nHeight,getaddr ? &addr : NULL, res.services, res.nConnectMs, res.nHandshakeMs);
     }
     db.ResultMany(ips);
     db.Add(addr);
@@ -202,121 +433,286 @@ extern "C" void* ThreadCrawler(void* data) {
   return nullptr;
 }
 
-extern "C" int GetIPList(void *thread, char *requestedHostname, addr_t *addr, int max, int ipv4, int ipv6);
+extern "C" int GetIPList(void *thread, int label, const dns_rr_t **rr, int max, int ipv4, int ipv6, int region);
 
 class CDnsThread {
 public:
-  struct FlagSpecificData {
-      int nIPv4, nIPv6;
-      std::vector<addr_t> cache;
-      time_t cacheTime;
-      unsigned int cacheHits;
-      FlagSpecificData() : nIPv4(0), nIPv6(0), cacheTime(0), cacheHits(0) {}
-  };
-
   dns_opt_t dns_opt; // must be first
   const int id;
-  std::map<uint64_t, FlagSpecificData> perflag;
-  std::atomic<uint64_t> dbQueries;
-  std::set<uint64_t> filterWhitelist;
-
-  void cacheHit(uint64_t requestedFlags, bool force = false) {
-    static bool nets[NET_MAX] = {};
-    if (!nets[NET_IPV4]) {
-        nets[NET_IPV4] = true;
-        nets[NET_IPV6] = true;
-    }
-    time_t now = time(NULL);
-    FlagSpecificData& thisflag = perflag[requestedFlags];
-    thisflag.cacheHits++;
-    if (force || thisflag.cacheHits * 400 > (thisflag.cache.size()*thisflag.cache.size()) || (thisflag.cacheHits*thisflag.cacheHits * 20 > thisflag.cache.size() && (now - thisflag.cacheTime > 5))) {
-      set<CNetAddr> ips;
-      db.GetIPs(ips, requestedFlags, 1000, nets);
-      dbQueries++;
-      thisflag.cache.clear();
-      thisflag.nIPv4 = 0;
-      thisflag.nIPv6 = 0;
-      thisflag.cache.reserve(ips.size());
-      for (set<CNetAddr>::iterator it = ips.begin(); it != ips.end(); it++) {
-        struct in_addr addr;
-        struct in6_addr addr6;
-        if ((*it).GetInAddr(&addr)) {
-          addr_t a;
-          a.v = 4;
-          memcpy(&a.data.v4, &addr, 4);
-          thisflag.cache.push_back(a);
-          thisflag.nIPv4++;
-        } else if ((*it).GetIn6Addr(&addr6)) {
-          addr_t a;
-          a.v = 6;
-          memcpy(&a.data.v6, &addr6, 16);
-          thisflag.cache.push_back(a);
-          thisflag.nIPv6++;
-        }
-      }
-      thisflag.cacheHits = 0;
-      thisflag.cacheTime = now;
-    }
-  }
+  int cpu; // CPU to pin this thread to, or -1
+  bool fTcp; // serve DNS over TCP instead of UDP
+  int reader; // our slot for reading db snapshots
+  uint64_t snapshotSeq; // the snapshot the state below belongs to
+  // per filter and per family (IPv4, IPv6, both), a permutation of the
+  // snapshot's addresses to draw answers from
+  std::map<uint64_t, std::vector<int> > order[3];
+  // per filter, the snapshot's addresses rendered as answer records,
+  // IPv4 then IPv6, and the TTL they carry
+  struct CRendered {
+    std::vector<dns_rr_t> rr;
+    int ttl;
+  };
+  std::map<uint64_t, CRendered> rendered;
+  int nGroupCap; // addresses per network group in an answer, 0 for any
+  bool fFastFirst; // order answers by handshake time
+  std::vector<int> picked; // indices drawn for the current answer
+  std::vector<int> deferred; // indices drawn while their group was full
+  std::vector<uint32_t> drawn; // drawn[i] == drawGen: index i was drawn for the current answer
+  std::vector<uint32_t> groupGen; // groupCount[g] is current if groupGen[g] == drawGen
+  std::vector<int> groupCount; // addresses of group g in the current answer
+  uint32_t drawGen;
+  std::map<uint64_t, int> filterSlot; // allowed filters, and their slot in dns_opt.stats.filter
+  std::vector<std::pair<uint64_t, int> > labelFilter; // by DNS label id: filter, and its slot
+  bool fAnswered; // served an address
+  std::atomic<bool> fStopped; // run() returned
 
-  CDnsThread(CDnsSeedOpts* opts, int idIn) : id(idIn) {
+  CDnsThread(CDnsSeedOpts* opts, int idIn, bool fTcpIn = false) : id(idIn), cpu(-1), fTcp(fTcpIn) {
     dns_opt.host = opts->host;
     dns_opt.ns = opts->ns;
     dns_opt.mbox = opts->mbox;
-    dns_opt.datattl = 3600;
+    dns_opt.datattl = db.GetTtl();
     dns_opt.nsttl = 40000;
     dns_opt.cb = GetIPList;
     dns_opt.port = opts->nPort;
-    dns_opt.nRequests = 0;
-    dbQueries = 0;
-    perflag.clear();
-    filterWhitelist = opts->filter_whitelist;
+    dns_opt.sock = -1;
+    dns_opt.batch = opts->nBatch;
+    dns_opt.uring = opts->fUring;
+    dns_opt.maxudp = opts->nMaxUdp;
+    dns_opt.maxanswers = opts->nMaxAnswers;
+    dns_opt.tcpidle = 10;
+    dns_opt.quit = 0;
+    dns_opt.rrl = NULL;
+    dns_opt.regions = regions;
+    dns_opt.qlog = NULL;
+    dns_opt.dnssec = dnssecKey ? &signedAnswers : NULL;
+    dns_opt.dnssecinuse = NULL;
+    dns_opt.dnssecpick = 0;
+    dns_opt.labels = NULL;
+    dns_opt.labelmask = 0;
+    dns_opt.nlabels = 0;
+    reader = db.RegisterReader();
+    if (reader < 0) {
+      fprintf(stderr, "No snapshot reader slot left for a DNS thread.\n");
+      exit(1);
+    }
+    snapshotSeq = 0;
+    nGroupCap = opts->nGroupCap;
+    fFastFirst = opts->fFastFirst;
+    drawGen = 0;
+    fAnswered = false;
+    fStopped = false;
+    // slot 0 counts unfiltered queries; filters beyond the last slot share it
+    int slot = 1;
+    for (std::set<uint64_t>::const_iterator it = opts->filter_whitelist.begin(); it != opts->filter_whitelist.end(); it++) {
+      filterSlot[*it] = slot;
+      // filters are asked for as x<flags in hex>.<host>
+      if (*it) {
+        char label[20];
+        snprintf(label, sizeof(label), "x%llx", (unsigned long long)*it);
+        dns_add_label(&dns_opt, label, labelFilter.size());
+        labelFilter.push_back(std::make_pair(*it, slot));
+      }
+      if (slot < DNS_FILTER_MAX - 1)
+        slot++;
+    }
+  }
+
+  // The records of good (for filter flags), numbered as in GetIPList with
+  // both families, rendered on first use per snapshot. On a TTL change only
+  // the TTLs are rewritten.
+  const std::vector<dns_rr_t> &Rendered(uint64_t flags, const CGoodSet *good) {
+    CRendered &r = rendered[flags];
+    unsigned int n4 = good->ipv4.size(), size = n4 + good->ipv6.size();
+    if (r.rr.size() != size) {
+      r.rr.resize(size);
+      for (unsigned int k = 0; k < size; k++) {
+        addr_t a;
+        if (k < n4) {
+          a.v = 4;
+          memcpy(a.data.v4, good->ipv4[k].ip, 4);
+        } else {
+          a.v = 6;
+          memcpy(a.data.v6, good->ipv6[k - n4].ip, 16);
+        }
+        dns_render_addr(&dns_opt, &a, &r.rr[k]);
+      }
+      r.ttl = dns_opt.datattl;
+    } else if (r.ttl != dns_opt.datattl) {
+      // owner pointer, type and class come first
+      r.ttl = dns_opt.datattl;
+      for (unsigned int k = 0; k < size; k++) {
+        r.rr[k].data[6] = r.ttl >> 24;
+        r.rr[k].data[7] = (r.ttl >> 16) & 0xFF;
+        r.rr[k].data[8] = (r.ttl >> 8) & 0xFF;
+        r.rr[k].data[9] = r.ttl & 0xFF;
+      }
+    }
+    return r.rr;
+  }
+
+  // Start drawing a new answer from size addresses in nGroups groups.
+  void NewDraw(unsigned int size, int nGroups) {
+    picked.clear();
+    deferred.clear();
+    if (drawn.size() < size)
+      drawn.resize(size, 0);
+    if (groupGen.size() < nGroups) {
+      groupGen.resize(nGroups, 0);
+      groupCount.resize(nGroups);
+    }
+    if (++drawGen == 0) {
+      std::fill(drawn.begin(), drawn.end(), 0);
+      std::fill(groupGen.begin(), groupGen.end(), 0);
+      drawGen = 1;
+    }
+  }
+
+  // Add address k (numbered as in GetIPList) to the answer, unless it is
+  // in already or its network group is full.
+  void Offer(const CGoodSet *good, unsigned int n4, int k) {
+    if (drawn[k] == drawGen)
+      return;
+    drawn[k] = drawGen;
+    if (nGroupCap > 0) {
+      int g = k < n4 ? good->group4[k] : good->group6[k - n4];
+      if (groupGen[g] != drawGen) {
+        groupGen[g] = drawGen;
+        groupCount[g] = 0;
+      }
+      if (groupCount[g] >= nGroupCap) {
+        deferred.push_back(k);
+        return;
+      }
+      groupCount[g]++;
+    }
+    picked.push_back(k);
+  }
+
+  // Offer up to max addresses in total from the union of two lists of
+  // indices into good->ipv4 and good->ipv6 (either may be NULL), at random.
+  void OfferFrom(const CGoodSet *good, unsigned int n4, const std::vector<int> *list4, const std::vector<int> *list6, int max) {
+    unsigned int s4 = list4 ? list4->size() : 0;
+    unsigned int size = s4 + (list6 ? list6->size() : 0);
+    if (size == 0)
+      return;
+    // j counts through the union, list4 first
+    if (size <= max - picked.size()) {
+      unsigned int j = GetFastRandRange(size);
+      for (unsigned int i = 0; i < size && picked.size() < max; i++, j = (j + 1) % size)
+        Offer(good, n4, j < s4 ? (*list4)[j] : n4 + (*list6)[j - s4]);
+    } else {
+      for (int tries = 4 * max + 16; picked.size() < max && tries > 0; tries--) {
+        unsigned int j = GetFastRandRange(size);
+        Offer(good, n4, j < s4 ? (*list4)[j] : n4 + (*list6)[j - s4]);
+      }
+    }
   }
 
   void run() {
-    dnsserver(&dns_opt);
+    if (cpu >= 0) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(cpu, &cpus);
+      pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+    if (fTcp)
+      dnstcpserver(&dns_opt);
+    else
+      dnsserver(&dns_opt);
+    fStopped = true;
   }
 };
 
-extern "C" int GetIPList(void *data, char *requestedHostname, addr_t* addr, int max, int ipv4, int ipv6) {
+// Orders indices into a CGoodSet (as numbered in GetIPList) by handshake time
+struct CRttOrder {
+  const CGoodSet *good;
+  unsigned int n4;
+  uint16_t Rtt(int k) const { return k < n4 ? good->rtt4[k] : good->rtt6[k - n4]; }
+  bool operator()(int a, int b) const { return Rtt(a) < Rtt(b); }
+};
+
+extern "C" int GetIPList(void *data, int label, const dns_rr_t **rr, int max, int ipv4, int ipv6, int region) {
   CDnsThread *thread = (CDnsThread*)data;
 
   uint64_t requestedFlags = 0;
-  int hostlen = strlen(requestedHostname);
-  if (hostlen > 1 && requestedHostname[0] == 'x' && requestedHostname[1] != '0') {
-    char *pEnd;
-    uint64_t flags = (uint64_t)strtoull(requestedHostname+1, &pEnd, 16);
-    if (*pEnd == '.' && pEnd <= requestedHostname+17 && std::find(thread->filterWhitelist.begin(), thread->filterWhitelist.end(), flags) != thread->filterWhitelist.end())
-      requestedFlags = flags;
-    else
-      return 0;
+  int slot = 0;
+  if (label >= 0) {
+    requestedFlags = thread->labelFilter[label].first;
+    slot = thread->labelFilter[label].second;
   }
-  else if (strcasecmp(requestedHostname, thread->dns_opt.host))
+  thread->dns_opt.stats.filter[slot].inc();
+  const CAddrSnapshot *snap = db.GetSnapshot(thread->reader);
+  if (snap->nSeq != thread->snapshotSeq) {
+    thread->snapshotSeq = snap->nSeq;
+    for (int i = 0; i < 3; i++)
+      thread->order[i].clear();
+    thread->rendered.clear();
+    // the SOA serial follows the good set
+    dns_prerender(&thread->dns_opt);
+  }
+  const CGoodSet *good = snap->Get(requestedFlags);
+  if (!good || !(ipv4 || ipv6))
     return 0;
-  thread->cacheHit(requestedFlags);
-  auto& thisflag = thread->perflag[requestedFlags];
-  unsigned int size = thisflag.cache.size();
-  unsigned int maxmax = (ipv4 ? thisflag.nIPv4 : 0) + (ipv6 ? thisflag.nIPv6 : 0);
+  // indices below n4 are IPv4 addresses, the rest IPv6
+  unsigned int n4 = ipv4 ? good->ipv4.size() : 0;
+  unsigned int n6 = ipv6 ? good->ipv6.size() : 0;
+  unsigned int size = n4 + n6;
+  int family = ipv4 && ipv6 ? 2 : (ipv6 ? 1 : 0);
+  const CAliasTable &pick = family == 2 ? good->pickAll : (family == 1 ? good->pick6 : good->pick4);
   if (max > size)
     max = size;
-  if (max > maxmax)
-    max = maxmax;
-  int i=0;
-  while (i<max) {
-    int j = i + (rand() % (size - i));
-    do {
-        bool ok = (ipv4 && thisflag.cache[j].v == 4) ||
-                  (ipv6 && thisflag.cache[j].v == 6);
-        if (ok) break;
-        j++;
-        if (j==size)
-            j=i;
-    } while(1);
-    addr[i] = thisflag.cache[j];
-    thisflag.cache[j] = thisflag.cache[i];
-    thisflag.cache[i] = addr[i];
-    i++;
+  std::vector<int> &picked = thread->picked;
+  thread->NewDraw(size, snap->nGroups);
+  if (region >= 0 && max < size) {
+    // nodes in the client's region first, then in its area
+    int area = region_area(thread->dns_opt.regions, region);
+    thread->OfferFrom(good, n4, ipv4 ? &good->region4[region] : NULL, ipv6 ? &good->region6[region] : NULL, max);
+    thread->OfferFrom(good, n4, ipv4 ? &good->area4[area] : NULL, ipv6 ? &good->area6[area] : NULL, max);
+  }
+  int tries = 4 * max + 16;
+  if (!pick.empty() && max < size) {
+    // weighted draws, skipping repeats
+    while (picked.size() < max && tries-- > 0)
+      thread->Offer(good, n4, pick.Draw());
+  } else {
+    std::vector<int> &order = thread->order[family][requestedFlags];
+    if (order.size() != size) {
+      order.resize(size);
+      for (unsigned int i = 0; i < size; i++)
+        order[i] = i;
+    }
+    // partial Fisher-Yates: a uniform sample, in the order drawn
+    for (int i = 0; i < size && picked.size() < max && tries-- > 0; i++) {
+      int j = i + GetFastRandRange(size - i);
+      std::swap(order[i], order[j]);
+      thread->Offer(good, n4, order[i]);
+    }
+  }
+  if (picked.size() < max) {
+    // the weights are very skewed, or few groups are left: go through the
+    // rest in index order, and then give up on spreading over groups
+    unsigned int k = GetFastRandRange(size);
+    for (unsigned int i = 0; i < size && picked.size() < max; i++, k = (k + 1) % size)
+      thread->Offer(good, n4, k);
+    for (unsigned int i = 0; i < thread->deferred.size() && picked.size() < max; i++)
+      picked.push_back(thread->deferred[i]);
   }
+  if (thread->fFastFirst) {
+    CRttOrder byRtt = {good, n4};
+    std::sort(picked.begin(), picked.end(), byRtt);
+  }
+  // the TTL follows the churn of the good set
+  thread->dns_opt.datattl = db.GetTtl();
+  if (max > 0 && !thread->fAnswered) {
+    thread->fAnswered = true;
+    int64_t none = 0;
+    nFirstAnswerMs.compare_exchange_strong(none, GetTimeMillis());
+  }
+  // picked numbers IPv6 addresses from n4, which is 0 without IPv4
+  const std::vector<dns_rr_t> &records = thread->Rendered(requestedFlags, good);
+  unsigned int skip4 = good->ipv4.size() - n4;
+  for (int i = 0; i < max; i++)
+    rr[i] = &records[picked[i] < n4 ? picked[i] : picked[i] + skip4];
   return max;
 }
 
@@ -358,11 +754,11 @@ extern "C" void* ThreadDumper(void*) {
         rename("dnsseed.dat.new", "dnsseed.dat");
       }
       FILE *d = fopen("dnsseed.dump", "w");
-      fprintf(d, "# address                                        good  lastSuccess    %%(2h)   %%(8h)   %%(1d)   %%(7d)  %%(30d)  blocks      svcs  version\n");
+      fprintf(d, "# address                                        good  lastSuccess    %%(2h)   %%(8h)   %%(1d)   %%(7d)  %%(30d)  blocks      svcs  version  conn(ms)  hs(ms)\n");
       double stat[5]={0,0,0,0,0};
       for (vector<CAddrReport>::const_iterator it = v.begin(); it < v.end(); it++) {
         CAddrReport rep = *it;
-        fprintf(d, "%-47s  %4d  %11" PRId64 "  %6.2f%% %6.2f%% %6.2f%% %6.2f%% %6.2f%%  %6i  %08" PRIx64 "  %5i \"%s\"\n", rep.ip.ToString().c_str(), (int)rep.fGood, rep.lastSuccess, 100.0*rep.uptime[0], 100.0*rep.uptime[1], 100.0*rep.uptime[2], 100.0*rep.uptime[3], 100.0*rep.uptime[4], rep.blocks, rep.services, rep.clientVersion, rep.clientSubVersion.c_str());
+        fprintf(d, "%-47s  %4d  %11" PRId64 "  %6.2f%% %6.2f%% %6.2f%% %6.2f%% %6.2f%%  %6i  %08" PRIx64 "  %5i \"%s\"  %6.0f  %6.0f\n", rep.ip.ToString().c_str(), (int)rep.fGood, rep.lastSuccess, 100.0*rep.uptime[0], 100.0*rep.uptime[1], 100.0*rep.uptime[2], 100.0*rep.uptime[3], 100.0*rep.uptime[4], rep.blocks, rep.services, rep.clientVersion, rep.clientSubVersion.c_str(), rep.connectMs, rep.handshakeMs);
         stat[0] += rep.uptime[0];
         stat[1] += rep.uptime[1];
         stat[2] += rep.uptime[2];
@@ -378,6 +774,74 @@ extern "C" void* ThreadDumper(void*) {
   return nullptr;
 }
 
+// smallest latency bound (in ns) below which fraction q of the requests
+// in histogram h were answered
+static uint64_t LatencyPercentile(const uint64_t *h, double q) {
+  uint64_t total = 0;
+  for (int i = 0; i < DNS_LATENCY_MAX; i++)
+    total += h[i];
+  uint64_t seen = 0;
+  for (int i = 0; i < DNS_LATENCY_MAX; i++) {
+    seen += h[i];
+    if (total && seen >= q * total)
+      return 1ULL << i;
+  }
+  return 0;
+}
+
+// Write the DNS metrics of all threads, summed, to metricsFile
+static void WriteMetrics() {
+  static const char *qtypes[DNS_QT_MAX] = {"A", "NS", "SOA", "AAAA", "ANY", "other", "none"};
+  uint64_t requests = 0, dropped = 0, slipped = 0, noreply = 0, truncated = 0;
+  uint64_t qtype[DNS_QT_MAX] = {}, rcode[DNS_RCODE_MAX] = {}, filter[DNS_FILTER_MAX] = {}, latency[DNS_LATENCY_MAX] = {};
+  for (unsigned int i=0; i<dnsThread.size(); i++) {
+    const dns_stats_t &st = dnsThread[i]->dns_opt.stats;
+    requests += st.requests.get();
+    dropped += st.dropped.get();
+    slipped += st.slipped.get();
+    noreply += st.noreply.get();
+    truncated += st.truncated.get();
+    for (int j = 0; j < DNS_QT_MAX; j++) qtype[j] += st.qtype[j].get();
+    for (int j = 0; j < DNS_RCODE_MAX; j++) rcode[j] += st.rcode[j].get();
+    for (int j = 0; j < DNS_FILTER_MAX; j++) filter[j] += st.filter[j].get();
+    for (int j = 0; j < DNS_LATENCY_MAX; j++) latency[j] += st.latency[j].get();
+  }
+  std::string tmp = std::string(metricsFile) + ".new";
+  FILE *f = fopen(tmp.c_str(), "w");
+  if (!f)
+    return;
+  fprintf(f, "requests %llu\ndropped %llu\nslipped %llu\nnoreply %llu\ntruncated %llu\n", (unsigned long long)requests, (unsigned long long)dropped, (unsigned long long)slipped, (unsigned long long)noreply, (unsigned long long)truncated);
+  for (int j = 0; j < DNS_QT_MAX; j++)
+    fprintf(f, "qtype %s %llu\n", qtypes[j], (unsigned long long)qtype[j]);
+  for (int j = 0; j < DNS_RCODE_MAX; j++)
+    if (rcode[j]) fprintf(f, "rcode %i %llu\n", j, (unsigned long long)rcode[j]);
+  if (!dnsThread.empty()) {
+    fprintf(f, "filter none %llu\n", (unsigned long long)filter[0]);
+    const std::map<uint64_t, int> &slots = dnsThread[0]->filterSlot;
+    bool fLastShown = false;
+    for (std::map<uint64_t, int>::const_iterator it = slots.begin(); it != slots.end(); it++) {
+      // filters that share the last slot are shown once, by the first of them
+      if (it->second == DNS_FILTER_MAX - 1) {
+        if (fLastShown)
+          continue;
+        fLastShown = true;
+      }
+      fprintf(f, "filter x%llx %llu\n", (unsigned long long)it->first, (unsigned long long)filter[it->second]);
+    }
+  }
+  for (int j = 0; j < DNS_LATENCY_MAX; j++)
+    if (latency[j]) fprintf(f, "latency_ns_lt %llu %llu\n", 1ULL << j, (unsigned long long)latency[j]);
+  fprintf(f, "answer_ttl %i\nchurn_per_hour %g\n", db.GetTtl(), db.GetChurn());
+  // since startup: first address served, first node found good by a test
+  int64_t firstAnswer = nFirstAnswerMs.load(), firstGood = db.GetFirstGoodTime();
+  fprintf(f, "warm_nodes %i\nfirst_answer_ms %lld\nfirst_good_ms %lld\n", db.GetWarmCount(), firstAnswer ? (long long)(firstAnswer - nStartMs) : -1LL, firstGood ? (long long)(firstGood - nStartMs) : -1LL);
+  if (qlog)
+    fprintf(f, "qlog_records %llu\nqlog_dropped %llu\n", (unsigned long long)qlog_written(qlog), (unsigned long long)qlog_dropped(qlog));
+  fprintf(f, "latency_ns_p50 %llu\nlatency_ns_p99 %llu\nlatency_ns_p999 %llu\n", (unsigned long long)LatencyPercentile(latency, 0.5), (unsigned long long)LatencyPercentile(latency, 0.99), (unsigned long long)LatencyPercentile(latency, 0.999));
+  fclose(f);
+  rename(tmp.c_str(), metricsFile);
+}
+
 extern "C" void* ThreadStats(void*) {
   bool first = true;
   do {
@@ -396,13 +860,241 @@ extern "C" void* ThreadStats(void*) {
       printf("\x1b[2K\x1b[u");
     printf("\x1b[s");
     uint64_t requests = 0;
-    uint64_t queries = 0;
+    uint64_t dropped = 0;
+    uint64_t slipped = 0;
+    uint64_t latency[DNS_LATENCY_MAX] = {};
     for (unsigned int i=0; i<dnsThread.size(); i++) {
-      requests += dnsThread[i]->dns_opt.nRequests;
-      queries += dnsThread[i]->dbQueries;
+      const dns_stats_t &st = dnsThread[i]->dns_opt.stats;
+      requests += st.requests.get();
+      dropped += st.dropped.get();
+      slipped += st.slipped.get();
+      for (int j = 0; j < DNS_LATENCY_MAX; j++)
+        latency[j] += st.latency[j].get();
     }
-    printf("%s %i/%i available (%i tried in %is, %i new, %i active), %i banned; %llu DNS requests, %llu db queries", c, stats.nGood, stats.nAvail, stats.nTracked, stats.nAge, stats.nNew, stats.nAvail - stats.nTracked - stats.nNew, stats.nBanned, (unsigned long long)requests, (unsigned long long)queries);
+    printf("%s %i/%i available (%i tried in %is, %i new, %i active), %i banned; %llu DNS requests (%llu dropped, %llu slipped, p99 < %lluus), %llu good set updates, TTL %is", c, stats.nGood, stats.nAvail, stats.nTracked, stats.nAge, stats.nNew, stats.nAvail - stats.nTracked - stats.nNew, stats.nBanned, (unsigned long long)requests, (unsigned long long)dropped, (unsigned long long)slipped, (unsigned long long)(LatencyPercentile(latency, 0.99) + 999) / 1000, (unsigned long long)db.GetSnapshotCount(), db.GetTtl());
+    db.UpdateTtl();
+    if (metricsFile)
+      WriteMetrics();
+    Sleep(1000);
+  } while(1);
+  return nullptr;
+}
+
+extern "C" void* ThreadQueryLog(void*) {
+  do {
+    qlog_flush(qlog);
+    Sleep(100);
+  } while(1);
+  return nullptr;
+}
+
+// rdata of a record rendered by dns_prerender or dns_render_addr, after
+// its owner pointer, type, class, TTL and length
+static std::vector<unsigned char> RenderedRdata(const unsigned char *rr, int len) {
+  return std::vector<unsigned char>(rr + 12, rr + len);
+}
+
+static uint32_t RenderedTtl(const unsigned char *rr) {
+  return ((uint32_t)rr[6] << 24) | (rr[7] << 16) | (rr[8] << 8) | rr[9];
+}
+
+// lowercase the first n names in rdata, which starts with them uncompressed
+static void LowercaseNames(std::vector<unsigned char> &rdata, int n) {
+  size_t pos = 0;
+  for (int i = 0; i < n && pos < rdata.size(); i++, pos++) {
+    while (pos < rdata.size() && rdata[pos]) {
+      size_t end = pos + 1 + rdata[pos];
+      for (pos++; pos < end && pos < rdata.size(); pos++)
+        rdata[pos] = tolower(rdata[pos]);
+    }
+  }
+}
+
+// Sign up to nSigBundles answers for label in family (ipv6 or not) at
+// owner, drawn the way unsigned answers are; false if signing failed
+static bool SignAddresses(CDnsThread *signer, int label, const unsigned char *owner, int ownerlen, int ipv6, uint32_t inception, uint32_t expiration, std::vector<dnssec_rrset_t> &out) {
+  dns_opt_t *opt = &signer->dns_opt;
+  int per = opt->maxanswers > 0 ? opt->maxanswers : 16;
+  std::vector<const dns_rr_t*> rr(per);
+  for (int b = 0; b < nSigBundles; b++) {
+    int n = GetIPList(signer, label, &rr[0], per, !ipv6, ipv6, -1);
+    if (n == 0)
+      break;
+    std::vector<std::vector<unsigned char> > rdata;
+    for (int i = 0; i < n; i++)
+      rdata.push_back(RenderedRdata(rr[i]->data, rr[i]->len));
+    out.push_back(dnssec_rrset_t());
+    if (!dnssec_sign(dnssecKey, opt->zone, opt->zonelen, owner, ownerlen, ipv6 ? DNSSEC_TYPE_AAAA : DNSSEC_TYPE_A, RenderedTtl(rr[0]->data), rdata, inception, expiration, &out.back()))
+      return false;
+    // all addresses fit in one answer; more would only reorder them
+    if (n < per)
+      break;
+  }
+  return true;
+}
+
+// Sign the addresses at owner (the apex or label), and its NSEC to next,
+// the following name in the chain
+static bool SignName(CDnsThread *signer, int label, const unsigned char *owner, int ownerlen, const unsigned char *next, int nextlen, uint32_t inception, uint32_t expiration, dnssec_name_t &name) {
+  dns_opt_t *opt = &signer->dns_opt;
+  if (!SignAddresses(signer, label, owner, ownerlen, 0, inception, expiration, name.a) || !SignAddresses(signer, label, owner, ownerlen, 1, inception, expiration, name.aaaa))
+    return false;
+  std::vector<int> types;
+  if (!name.a.empty())
+    types.push_back(DNSSEC_TYPE_A);
+  if (!name.aaaa.empty())
+    types.push_back(DNSSEC_TYPE_AAAA);
+  if (label == DNS_LABEL_APEX) {
+    types.push_back(DNSSEC_TYPE_NS);
+    types.push_back(DNSSEC_TYPE_SOA);
+    types.push_back(DNSSEC_TYPE_DNSKEY);
+  }
+  types.push_back(DNSSEC_TYPE_RRSIG);
+  types.push_back(DNSSEC_TYPE_NSEC);
+  std::vector<std::vector<unsigned char> > rdata(1, dnssec_nsec(next, nextlen, types));
+  // negative answers are cached for the SOA TTL at most (RFC 9077)
+  return dnssec_sign(dnssecKey, opt->zone, opt->zonelen, owner, ownerlen, DNSSEC_TYPE_NSEC, opt->nsttl, rdata, inception, expiration, &name.nsec);
+}
+
+// Orders label ids of a dnssec_answers_t canonically: lowercase labels as
+// unsigned bytes, a prefix first
+struct CLabelOrder {
+  const dnssec_answers_t *answers;
+  bool operator()(int a, int b) const {
+    const std::vector<unsigned char> &la = answers->labels[a].label, &lb = answers->labels[b].label;
+    return std::lexicographical_compare(la.begin() + 1, la.end(), lb.begin() + 1, lb.end());
+  }
+};
+
+// A new generation of signed answers from the current good set, or NULL
+static dnssec_answers_t *SignAnswers(CDnsThread *signer) {
+  dns_opt_t *opt = &signer->dns_opt;
+  dns_prerender(opt);
+  // an hour of slack for resolvers with slow clocks; re-signed daily
+  uint32_t now = time(NULL), inception = now - 3600, expiration = now + 7 * 86400;
+  dnssec_answers_t *answers = new dnssec_answers_t;
+  std::vector<std::vector<unsigned char> > ns(1, RenderedRdata(opt->ns_rr, opt->ns_rrlen));
+  std::vector<std::vector<unsigned char> > soa(1, RenderedRdata(opt->soa_rr, opt->soa_rrlen));
+  std::vector<std::vector<unsigned char> > dnskey(1, dnssec_dnskey(dnssecKey));
+  LowercaseNames(ns[0], 1);
+  LowercaseNames(soa[0], 2);
+  // our names: the apex, then x<flags in hex>.<host> as registered with
+  // dns_add_label, in the canonical order of the NSEC chain
+  unsigned int nLabels = signer->labelFilter.size();
+  std::vector<std::vector<unsigned char> > owners(nLabels);
+  answers->labels.resize(nLabels);
+  bool ok = true;
+  for (unsigned int i = 0; i < nLabels; i++) {
+    char label[64];
+    int len = snprintf(label, sizeof(label), "x%llx", (unsigned long long)signer->labelFilter[i].first);
+    std::vector<unsigned char> &l = answers->labels[i].label;
+    l.push_back(len);
+    l.insert(l.end(), label, label + len);
+    owners[i] = l;
+    owners[i].insert(owners[i].end(), opt->zone, opt->zone + opt->zonelen);
+    ok = ok && owners[i].size() <= 255;
+    answers->order.push_back(i);
+  }
+  CLabelOrder byLabel = {answers};
+  std::sort(answers->order.begin(), answers->order.end(), byLabel);
+  const unsigned char *first = nLabels ? &owners[answers->order[0]][0] : opt->zone;
+  int firstlen = nLabels ? owners[answers->order[0]].size() : opt->zonelen;
+  ok = ok && opt->ns_rrlen > 12 && opt->soa_rrlen > 12 &&
+       dnssec_sign(dnssecKey, opt->zone, opt->zonelen, opt->zone, opt->zonelen, DNSSEC_TYPE_NS, opt->nsttl, ns, inception, expiration, &answers->ns) &&
+       dnssec_sign(dnssecKey, opt->zone, opt->zonelen, opt->zone, opt->zonelen, DNSSEC_TYPE_SOA, opt->nsttl, soa, inception, expiration, &answers->soa) &&
+       dnssec_sign(dnssecKey, opt->zone, opt->zonelen, opt->zone, opt->zonelen, DNSSEC_TYPE_DNSKEY, opt->nsttl, dnskey, inception, expiration, &answers->dnskey) &&
+       SignName(signer, DNS_LABEL_APEX, opt->zone, opt->zonelen, first, firstlen, inception, expiration, answers->apex);
+  for (unsigned int k = 0; ok && k < nLabels; k++) {
+    // the last name links back to the apex
+    int i = answers->order[k];
+    const unsigned char *next = k + 1 < nLabels ? &owners[answers->order[k + 1]][0] : opt->zone;
+    int nextlen = k + 1 < nLabels ? owners[answers->order[k + 1]].size() : opt->zonelen;
+    ok = SignName(signer, i, &owners[i][0], owners[i].size(), next, nextlen, inception, expiration, answers->labels[i]);
+  }
+  if (!ok) {
+    delete answers;
+    return NULL;
+  }
+  return answers;
+}
+
+// Keep signedAnswers signed for the current good set: re-sign when it
+// changes, at most every 10 seconds, and daily to renew the signatures.
+// The first generation is signed before the DNS threads start.
+extern "C" void* ThreadSigner(void* arg) {
+  CDnsThread *signer = (CDnsThread*)arg;
+  // replaced generations, freed once no DNS thread announces them
+  std::vector<const dnssec_answers_t*> retired;
+  uint64_t seq = signer->snapshotSeq;
+  int64_t signedMs = GetTimeMillis();
+  do {
     Sleep(1000);
+    int64_t now = GetTimeMillis();
+    uint64_t snapSeq = db.GetSnapshot(signer->reader)->nSeq;
+    if ((snapSeq != seq && now - signedMs >= 10000) || now - signedMs >= 86400000) {
+      seq = snapSeq;
+      signedMs = now;
+      dnssec_answers_t *answers = SignAnswers(signer);
+      if (answers)
+        retired.push_back(signedAnswers.exchange(answers));
+      else
+        fprintf(stderr, "\nDNSSEC signing failed; keeping the previous signatures.\n");
+    }
+    for (int i = retired.size() - 1; i >= 0; i--) {
+      bool inUse = false;
+      for (unsigned int t = 0; t < dnsThread.size() && !inUse; t++)
+        inUse = dnsThread[t]->dns_opt.dnssecinuse.load() == retired[i];
+      if (!inUse) {
+        delete retired[i];
+        retired.erase(retired.begin() + i);
+      }
+    }
+  } while(1);
+  return nullptr;
+}
+
+// Wait for a new seeder at path and hand it our DNS sockets and nodes;
+// exit once it serves on them.
+extern "C" void* ThreadHandover(void* arg) {
+  const char *path = (const char*)arg;
+  int sock = handover_listen(path);
+  if (sock < 0) {
+    fprintf(stderr, "Unable to listen for a handover on %s: %s\n", path, strerror(errno));
+    return nullptr;
+  }
+  do {
+    int conn = handover_accept(sock);
+    if (conn < 0)
+      continue;
+    // UDP sockets first; threads may share one
+    std::vector<int> fds;
+    for (unsigned int i=0; i<dnsThread.size(); i++)
+      if (!dnsThread[i]->fTcp && std::find(fds.begin(), fds.end(), dnsThread[i]->dns_opt.sock) == fds.end())
+        fds.push_back(dnsThread[i]->dns_opt.sock);
+    int nUdp = fds.size();
+    for (unsigned int i=0; i<dnsThread.size(); i++)
+      if (dnsThread[i]->fTcp)
+        fds.push_back(dnsThread[i]->dns_opt.sock);
+    CDataStream ds(SER_DISK);
+    ds << db;
+    if (handover_send(conn, &fds[0], nUdp, fds.size() - nUdp, ds.str()) == 0 && handover_wait_ack(conn, 60) == 0) {
+      // let the UDP threads answer what they hold; the new seeder gets
+      // everything after. A thread waiting on an idle socket holds nothing.
+      for (unsigned int i=0; i<dnsThread.size(); i++)
+        dnsThread[i]->dns_opt.quit = 1;
+      int64_t deadline = GetTimeMillis() + 1000;
+      for (unsigned int i=0; i<dnsThread.size(); i++)
+        while (!dnsThread[i]->fTcp && !dnsThread[i]->fStopped && GetTimeMillis() < deadline)
+          Sleep(1);
+      // TCP clients get answers to what they sent, unless they stall
+      for (unsigned int i=0; i<dnsThread.size(); i++)
+        while (dnsThread[i]->fTcp && !dnsThread[i]->fStopped && GetTimeMillis() < deadline + dnsThread[i]->dns_opt.tcpidle * 1000)
+          Sleep(1);
+      printf("\nHanded the DNS sockets over to the new seeder; exiting.\n");
+      _exit(0);
+    }
+    fprintf(stderr, "\nHandover on %s failed; still serving.\n", path);
+    close(conn);
   } while(1);
   return nullptr;
 }
@@ -456,6 +1148,7 @@ extern "C" void* ThreadSeeder(void*) {
 }
 
 int main(int argc, char **argv) {
+  nStartMs = GetTimeMillis();
   signal(SIGPIPE, SIG_IGN);
   setbuf(stdout, NULL);
   CDnsSeedOpts opts;
@@ -512,29 +1205,190 @@ int main(int argc, char **argv) {
     fprintf(stderr, "No e-mail address set. Please use -m.\n");
     exit(1);
   }
-  // TODO: Output file-name customizations ...
-  FILE *f = fopen("dnsseed.dat","r");
-  if (f) {
-    printf("Loading dnsseed.dat...");
-    CAutoFile cf(f);
-    cf >> db;
+  // a seeder already running hands us its sockets and nodes
+  std::vector<int> handUdp, handTcp;
+  int handConn = -1;
+  if (fDNS && opts.handoverPath)
+    handConn = handover_connect(opts.handoverPath);
+  bool fLoaded = false;
+  if (handConn >= 0) {
+    std::string data;
+    if (handover_recv(handConn, handUdp, handTcp, data)) {
+      fprintf(stderr, "Handover from the seeder on %s failed.\n", opts.handoverPath);
+      exit(1);
+    }
+    printf("Taking over %i DNS sockets and %i bytes of nodes from the running seeder...", (int)(handUdp.size() + handTcp.size()), (int)data.size());
+    CDataStream ds(data.data(), data.data() + data.size(), SER_DISK);
+    ds >> db;
+    fLoaded = true;
+    // every socket must be served, or the queries hashed to it are lost
+    if (opts.nDnsThreads < (int)handUdp.size())
+      opts.nDnsThreads = handUdp.size();
+  } else {
+    // TODO: Output file-name customizations ...
+    FILE *f = fopen("dnsseed.dat","r");
+    if (f) {
+      printf("Loading dnsseed.dat...");
+      CAutoFile cf(f);
+      cf >> db;
+      fLoaded = true;
+    }
+  }
+  if (fLoaded) {
     if (opts.fWipeBan)
         db.banned.clear();
     if (opts.fWipeIgnore)
         db.ResetIgnores();
     printf("done\n");
+    if (db.GetWarmCount())
+      printf("Serving %i nodes from before the restart until they are tested again\n", db.GetWarmCount());
   }
-  pthread_t threadDns, threadSeed, threadDump, threadStats;
+  // DNS threads read the good set from snapshots; 0 is the unfiltered name
+  std::set<uint64_t> filters = opts.filter_whitelist;
+  filters.insert(0);
+  if (opts.regionFile) {
+    regions = region_load(opts.regionFile);
+    if (!regions)
+      exit(1);
+    printf("Loaded %i regions from %s\n", region_count(regions), opts.regionFile);
+  }
+  if (opts.qlogFile) {
+    qlog = qlog_create(opts.qlogFile, (long)opts.nQlogSize << 20, opts.nQlogFiles);
+    if (!qlog)
+      exit(1);
+    printf("Logging DNS queries to %s\n", opts.qlogFile);
+  }
+  if (opts.metricsFile) {
+    metricsFile = opts.metricsFile;
+    printf("Writing DNS metrics to %s\n", metricsFile);
+  }
+  if (fDNS && opts.dnskeyFile) {
+    dnssecKey = dnssec_load_key(opts.dnskeyFile);
+    if (!dnssecKey)
+      exit(1);
+    nSigBundles = opts.nSigBundles;
+  }
+  if (!opts.dnsCpus.empty()) {
+    // low-latency mode: every thread started from here on inherits the
+    // CPUs left over; the DNS threads then move to their own
+    cpu_set_t all, others;
+    pthread_getaffinity_np(pthread_self(), sizeof(all), &all);
+    others = all;
+    for (size_t i = 0; i < opts.dnsCpus.size(); i++) {
+      if (!CPU_ISSET(opts.dnsCpus[i], &all)) {
+        fprintf(stderr, "CPU %i is not available for DNS threads.\n", opts.dnsCpus[i]);
+        exit(1);
+      }
+      CPU_CLR(opts.dnsCpus[i], &others);
+    }
+    if (CPU_COUNT(&others))
+      pthread_setaffinity_np(pthread_self(), sizeof(others), &others);
+    else
+      fprintf(stderr, "No CPUs left for the crawlers; they share the DNS CPUs.\n");
+    // page faults in the DNS threads would cost milliseconds; locking
+    // without the privilege to would make later allocations fail instead
+    struct rlimit limit;
+    if (geteuid() != 0 && (getrlimit(RLIMIT_MEMLOCK, &limit) || limit.rlim_cur != RLIM_INFINITY))
+      fprintf(stderr, "Not locking memory: run as root or raise the memlock limit (ulimit -l unlimited).\n");
+    else if (mlockall(MCL_CURRENT | MCL_FUTURE))
+      fprintf(stderr, "Unable to lock memory: %s\n", strerror(errno));
+  }
+  db.SetTtlBounds(opts.nMinTtl, opts.nMaxTtl);
+  // DNS threads, the TCP thread and the signer
+  db.InitSnapshots(filters, fDNS ? opts.nDnsThreads + !opts.fNoTcp + (dnssecKey != NULL) : 0, opts.nWeightMode, regions);
+  pthread_t threadDns, threadSeed, threadDump, threadStats, threadQlog, threadHandover, threadSigner;
   if (fDNS) {
+    CDnsThread *signer = NULL;
+    if (dnssecKey) {
+      // draws answers like a DNS thread, to sign instead of serve
+      signer = new CDnsThread(&opts, -1);
+      signer->fAnswered = true;
+      dns_prerender(&signer->dns_opt);
+      std::vector<unsigned char> ds = dnssec_ds(dnssecKey, signer->dns_opt.zone, signer->dns_opt.zonelen);
+      printf("Signing answers with DNSSEC key %i; publish this DS record in the parent zone:\n%s. IN DS %i %i %i ", dnssec_key_tag(dnssecKey), opts.host, (ds[0] << 8) | ds[1], ds[2], ds[3]);
+      for (size_t i = 4; i < ds.size(); i++)
+        printf("%02X", ds[i]);
+      printf("\n");
+      signedAnswers = SignAnswers(signer);
+      if (!signedAnswers) {
+        fprintf(stderr, "DNSSEC signing failed.\n");
+        exit(1);
+      }
+    }
     printf("Starting %i DNS threads for %s on %s (port %i)...", opts.nDnsThreads, opts.host, opts.ns, opts.nPort);
     dnsThread.clear();
+    cookie_init();
+    rrl_t *rrl = NULL;
+    if (opts.nRrlRate)
+      rrl = rrl_create(opts.nRrlRate, opts.nRrlBurst ? opts.nRrlBurst : opts.nRrlRate, opts.nRrlSlip);
+    // bind all sockets up front, so that their order in the SO_REUSEPORT
+    // group matches the thread ids
+    int nShared = 0;
     for (int i=0; i<opts.nDnsThreads; i++) {
       dnsThread.push_back(new CDnsThread(&opts, i));
+      dnsThread[i]->dns_opt.rrl = rrl;
+      dnsThread[i]->dns_opt.qlog = qlog ? qlog_add_ring(qlog) : NULL;
+      int sock = i < (int)handUdp.size() ? handUdp[i] : dnslisten(&dnsThread[i]->dns_opt);
+      if (sock < 0 && i == 0) {
+        fprintf(stderr, "Unable to bind DNS socket on port %i.\n", opts.nPort);
+        exit(1);
+      }
+      // without SO_REUSEPORT, the threads share the first socket
+      if (sock < 0 && nShared++ == 0)
+        fprintf(stderr, "Unable to bind a DNS socket per thread (SO_REUSEPORT), threads share the first one.\n");
+      dnsThread[i]->dns_opt.sock = sock < 0 ? dnsThread[0]->dns_opt.sock : sock;
+      if (sock >= 0 && !opts.dnsCpus.empty() && opts.nBusyPoll && dnsbusypoll(sock, opts.nBusyPoll) && i == 0)
+        fprintf(stderr, "Unable to busy poll DNS sockets: %s\n", strerror(errno));
+    }
+    // in low-latency mode, thread i runs on the i-th DNS CPU, and with
+    // steering gets what that CPU received
+    for (int i=0; i<opts.nDnsThreads && !opts.dnsCpus.empty(); i++)
+      dnsThread[i]->cpu = opts.dnsCpus[i % opts.dnsCpus.size()];
+    if (opts.fSteerCpu && nShared) {
+      fprintf(stderr, "Not steering DNS queries to CPUs, as threads share a socket.\n");
+    } else if (opts.fSteerCpu) {
+      int nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+      int nMapped = std::min((int)opts.dnsCpus.size(), opts.nDnsThreads);
+      // only pin threads to CPUs when queries are steered to match
+      if (dnssteer(dnsThread[0]->dns_opt.sock, opts.nDnsThreads, nMapped ? &opts.dnsCpus[0] : NULL, nMapped) == 0) {
+        for (int i=0; i<opts.nDnsThreads && opts.dnsCpus.empty(); i++)
+          dnsThread[i]->cpu = i % nCpus;
+      } else {
+        fprintf(stderr, "Unable to attach CPU steering program, using kernel hashing.\n");
+      }
+    }
+    for (int i=0; i<opts.nDnsThreads; i++) {
       pthread_create(&threadDns, NULL, ThreadDNS, dnsThread[i]);
       printf(".");
       Sleep(20);
     }
+    if (!opts.fNoTcp) {
+      CDnsThread *tcpThread = new CDnsThread(&opts, opts.nDnsThreads, true);
+      tcpThread->dns_opt.qlog = qlog ? qlog_add_ring(qlog) : NULL;
+      tcpThread->dns_opt.sock = handTcp.empty() ? dnslistentcp(&tcpThread->dns_opt) : handTcp[0];
+      if (tcpThread->dns_opt.sock < 0) {
+        fprintf(stderr, "Unable to listen for DNS over TCP on port %i.\n", opts.nPort);
+        exit(1);
+      }
+      dnsThread.push_back(tcpThread);
+      pthread_create(&threadDns, NULL, ThreadDNS, tcpThread);
+    }
+    if (qlog)
+      pthread_create(&threadQlog, NULL, ThreadQueryLog, NULL);
+    // it goes through dnsThread, which is complete now
+    if (signer)
+      pthread_create(&threadSigner, NULL, ThreadSigner, signer);
     printf("done\n");
+    if (opts.fNoTcp)
+      for (size_t i = 0; i < handTcp.size(); i++)
+        close(handTcp[i]);
+    // we serve now; the old seeder exits, and we wait for the next one
+    if (handConn >= 0) {
+      handover_ack(handConn);
+      close(handConn);
+    }
+    if (opts.handoverPath)
+      pthread_create(&threadHandover, NULL, ThreadHandover, (void*)opts.handoverPath);
   }
   printf("Starting seeder...");
   pthread_create(&threadSeed, NULL, ThreadSeeder, NULL);
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "qlog.h"
+
+// Records per ring; a thread that gets this far ahead of the writer
+// loses records instead of waiting.
+#define QLOG_RING (1 << 14)
+
+// Single producer, single consumer: the DNS thread only moves head, the
+// writer only moves tail, each on its own cache line.
+struct qlog_ring_t {
+  std::atomic<uint64_t> head;
+  unsigned char pad0[56];
+  std::atomic<uint64_t> tail;
+  unsigned char pad1[56];
+  std::atomic<uint64_t> dropped; // written by the producer only
+  qlog_rec_t recs[QLOG_RING];
+};
+
+struct qlog_t {
+  std::string path;
+  long maxbytes;
+  int nfiles;
+  FILE *file;
+  long size; // of file
+  std::atomic<uint64_t> written;
+  std::vector<qlog_ring_t*> rings;
+};
+
+static std::string rotated_name(const qlog_t *log, int n) {
+  char suffix[16];
+  snprintf(suffix, sizeof(suffix), ".%i", n);
+  return log->path + suffix;
+}
+
+// close the current file, if any, shift the old ones up by one and start
+// a new one
+static bool qlog_open(qlog_t *log) {
+  if (log->file)
+    fclose(log->file);
+  for (int i = log->nfiles - 1; i > 0; i--)
+    rename((i > 1 ? rotated_name(log, i - 1) : log->path).c_str(), rotated_name(log, i).c_str());
+  log->file = fopen(log->path.c_str(), "wb");
+  if (!log->file)
+    return false;
+  qlog_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, QLOG_MAGIC, sizeof(header.magic));
+  header.recsize = sizeof(qlog_rec_t);
+  fwrite(&header, sizeof(header), 1, log->file);
+  log->size = sizeof(header);
+  return true;
+}
+
+qlog_t *qlog_create(const char *path, long maxbytes, int nfiles) {
+  qlog_t *log = new qlog_t;
+  log->path = path;
+  log->maxbytes = maxbytes;
+  log->nfiles = nfiles < 1 ? 1 : nfiles;
+  log->file = NULL;
+  log->written = 0;
+  // an existing log is kept as path.1
+  if (!qlog_open(log)) {
+    fprintf(stderr, "Cannot open query log %s\n", path);
+    delete log;
+    return NULL;
+  }
+  return log;
+}
+
+qlog_ring_t *qlog_add_ring(qlog_t *log) {
+  qlog_ring_t *ring = new qlog_ring_t;
+  ring->head = 0;
+  ring->tail = 0;
+  ring->dropped = 0;
+  log->rings.push_back(ring);
+  return ring;
+}
+
+void qlog_set_prefix(qlog_rec_t *rec, int family, const unsigned char *ip) {
+  memset(rec->prefix, 0, sizeof(rec->prefix));
+  rec->family = family;
+  memcpy(rec->prefix, ip, family == 4 ? 3 : 6);
+}
+
+void qlog_push(qlog_ring_t *ring, const qlog_rec_t *rec) {
+  uint64_t head = ring->head.load(std::memory_order_relaxed);
+  if (head - ring->tail.load(std::memory_order_acquire) >= QLOG_RING) {
+    ring->dropped.store(ring->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    return;
+  }
+  ring->recs[head % QLOG_RING] = *rec;
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+int qlog_flush(qlog_t *log) {
+  int n = 0;
+  for (size_t i = 0; i < log->rings.size(); i++) {
+    qlog_ring_t *ring = log->rings[i];
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    while (tail != head) {
+      // up to the end of the ring, then from its start
+      uint64_t count = head - tail;
+      if (tail % QLOG_RING + count > QLOG_RING)
+        count = QLOG_RING - tail % QLOG_RING;
+      if (log->file && log->size + (long)(count * sizeof(qlog_rec_t)) > log->maxbytes && log->size > (long)sizeof(qlog_header_t) && !qlog_open(log))
+        fprintf(stderr, "Cannot open query log %s\n", log->path.c_str());
+      if (log->file) {
+        fwrite(&ring->recs[tail % QLOG_RING], sizeof(qlog_rec_t), count, log->file);
+        log->size += count * sizeof(qlog_rec_t);
+      }
+      tail += count;
+      n += count;
+      ring->tail.store(tail, std::memory_order_release);
+    }
+  }
+  if (log->file) {
+    fflush(log->file);
+    log->written += n;
+  }
+  return n;
+}
+
+uint64_t qlog_written(const qlog_t *log) {
+  return log->written;
+}
+
+uint64_t qlog_dropped(const qlog_t *log) {
+  uint64_t dropped = 0;
+  for (size_t i = 0; i < log->rings.size(); i++)
+    dropped += log->rings[i]->dropped.load(std::memory_order_relaxed);
+  return dropped;
+}
@@ -0,0 +1,73 @@
+#ifndef _QLOG_H_
+#define _QLOG_H_ 1
+
+#include <stdint.h>
+
+// Query log: a compact record of every query the DNS threads handled, to
+// see what real traffic looks like without a packet capture, and to
+// replay it against a test seeder with dnsbench -f. Each DNS thread fills
+// its own ring without locks; a single writer drains the rings into a
+// file that is rotated by size.
+//
+// The file is a qlog_header_t followed by qlog_rec_t records, in host
+// byte order. Records from different threads are only roughly in time
+// order.
+
+#define QLOG_MAGIC "DNSQLOG1"
+
+struct qlog_header_t {
+  char magic[8];
+  uint32_t recsize; // sizeof(qlog_rec_t) of the writer
+  uint32_t reserved;
+};
+
+enum {
+  QLOG_TCP = 1,
+  QLOG_EDNS = 2,
+  QLOG_ECS = 4,    // prefix is the client subnet a resolver passed on
+  QLOG_COOKIE = 8,
+  QLOG_DO = 16,    // DNSSEC OK
+};
+
+#define QLOG_LABEL_FOREIGN -3 // not in the zone, or no name could be parsed
+#define QLOG_NOREPLY 255      // rcode of a query that got no reply
+
+struct qlog_rec_t {
+  uint64_t time;     // microseconds since the epoch
+  uint32_t qhash;    // FNV-1a of the question name in lowercase wire format
+  uint16_t qtype;
+  uint16_t answers;  // answer section count of the reply
+  uint16_t udpsize;  // advertised with EDNS0, else 0
+  int16_t label;     // DNS_LABEL_APEX, DNS_LABEL_NONE, QLOG_LABEL_FOREIGN or a label id
+  uint8_t rcode;     // extended rcode, or QLOG_NOREPLY
+  uint8_t flags;     // QLOG_*
+  uint8_t family;    // of prefix: 4 or 6
+  uint8_t namelen;   // question name length in wire format
+  uint8_t prefix[8]; // client /24 or /48
+  char first[16];    // first label of the name, NUL padded, cut to 16 bytes
+};
+
+struct qlog_t;
+struct qlog_ring_t;
+
+// log to path, moving it to path.1 (and so on, up to path.<nfiles-1>)
+// once it reaches maxbytes; NULL if path cannot be opened
+qlog_t *qlog_create(const char *path, long maxbytes, int nfiles);
+
+// a ring for one DNS thread; call before the threads and the writer start
+qlog_ring_t *qlog_add_ring(qlog_t *log);
+
+// set the prefix of rec from ip (4 or 16 bytes for family 4 or 6)
+void qlog_set_prefix(qlog_rec_t *rec, int family, const unsigned char *ip);
+
+// called only by the thread owning ring; the record is lost if it is full
+void qlog_push(qlog_ring_t *ring, const qlog_rec_t *rec);
+
+// write out what the rings hold; called only by the writer thread.
+// Returns the number of records written.
+int qlog_flush(qlog_t *log);
+
+uint64_t qlog_written(const qlog_t *log);
+uint64_t qlog_dropped(const qlog_t *log); // lost to full rings
+
+#endif
@@ -0,0 +1,198 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "region.h"
+
+// Addresses are keyed by their top 64 bits: an IPv4 address sits in the
+// high half. The prefixes are flattened into sorted, disjoint ranges, so
+// a lookup is one binary search.
+struct region_range_t {
+  uint64_t start;
+  uint64_t end; // inclusive
+  int region;
+};
+
+struct region_prefix_t {
+  uint64_t start;
+  uint64_t end;
+  int len;
+  int region;
+  int line; // later lines win over equal prefixes
+  bool operator<(const region_prefix_t &b) const {
+    if (start != b.start) return start < b.start;
+    if (len != b.len) return len < b.len;
+    return line < b.line;
+  }
+};
+
+struct region_t {
+  std::vector<std::string> names;
+  std::vector<int> area; // per region
+  int nAreas;
+  std::vector<region_range_t> ranges[2]; // IPv4, IPv6
+};
+
+static uint64_t key_of(int family, const unsigned char *ip) {
+  uint64_t key = 0;
+  int n = family == 4 ? 4 : 8;
+  for (int i = 0; i < n; i++)
+    key = (key << 8) | ip[i];
+  return family == 4 ? key << 32 : key;
+}
+
+static uint64_t prefix_mask(int len) {
+  return len == 0 ? 0 : ~0ULL << (64 - len);
+}
+
+// Turn nested or disjoint prefixes, sorted outer before inner, into
+// disjoint ranges labelled with the innermost prefix.
+static void flatten(const std::vector<region_prefix_t> &prefixes, std::vector<region_range_t> &ranges) {
+  std::vector<const region_prefix_t*> open;
+  uint64_t pos = 0; // first address not yet emitted
+  bool done = false; // pos wrapped past the top
+  for (size_t i = 0; i <= prefixes.size(); i++) {
+    const region_prefix_t *p = i < prefixes.size() ? &prefixes[i] : NULL;
+    // close the prefixes that end before p starts
+    while (!open.empty() && (!p || open.back()->end < p->start)) {
+      const region_prefix_t *top = open.back();
+      open.pop_back();
+      if (!done && pos <= top->end) {
+        region_range_t r = {pos, top->end, top->region};
+        ranges.push_back(r);
+        pos = top->end + 1;
+        done = pos == 0;
+      }
+    }
+    if (!p)
+      break;
+    if (!open.empty() && !done && pos < p->start) {
+      region_range_t r = {pos, p->start - 1, open.back()->region};
+      ranges.push_back(r);
+    }
+    pos = p->start;
+    done = false;
+    open.push_back(p);
+  }
+}
+
+region_t *region_load(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    fprintf(stderr, "Cannot open region table %s\n", path);
+    return NULL;
+  }
+  region_t *regions = new region_t;
+  std::map<std::string, int> ids, areas;
+  std::vector<region_prefix_t> prefixes[2];
+  char line[512];
+  int nLine = 0;
+  while (fgets(line, sizeof(line), f)) {
+    nLine++;
+    char *hash = strchr(line, '#');
+    if (hash)
+      *hash = 0;
+    char prefix[256], name[256];
+    int n = sscanf(line, "%255s %255s", prefix, name);
+    if (n <= 0)
+      continue;
+    char *slash = strchr(prefix, '/');
+    int len = -1;
+    if (slash) {
+      *slash = 0;
+      len = atoi(slash + 1);
+    }
+    unsigned char ip[16];
+    int family = 0;
+    if (inet_pton(AF_INET, prefix, ip) == 1)
+      family = 4;
+    else if (inet_pton(AF_INET6, prefix, ip) == 1)
+      family = 6;
+    if (n != 2 || !family || len < 0 || len > (family == 4 ? 32 : 128)) {
+      fprintf(stderr, "%s:%i: expected <prefix>/<length> <region>\n", path, nLine);
+      fclose(f);
+      delete regions;
+      return NULL;
+    }
+    if (len > 64)
+      len = 64;
+    std::map<std::string, int>::iterator it = ids.find(name);
+    if (it == ids.end()) {
+      it = ids.insert(std::make_pair(std::string(name), (int)regions->names.size())).first;
+      regions->names.push_back(name);
+      std::string area(name, strcspn(name, "-"));
+      regions->area.push_back(areas.insert(std::make_pair(area, (int)areas.size())).first->second);
+    }
+    region_prefix_t p;
+    uint64_t mask = prefix_mask(len);
+    p.start = key_of(family, ip) & mask;
+    p.end = p.start | ~mask;
+    p.len = len;
+    p.region = it->second;
+    p.line = nLine;
+    prefixes[family == 4 ? 0 : 1].push_back(p);
+  }
+  fclose(f);
+  regions->nAreas = areas.size();
+  for (int i = 0; i < 2; i++) {
+    std::sort(prefixes[i].begin(), prefixes[i].end());
+    flatten(prefixes[i], regions->ranges[i]);
+  }
+  return regions;
+}
+
+int region_count(const region_t *regions) {
+  return regions->names.size();
+}
+
+int region_area_count(const region_t *regions) {
+  return regions->nAreas;
+}
+
+int region_area(const region_t *regions, int region) {
+  return regions->area[region];
+}
+
+const char *region_name(const region_t *regions, int region) {
+  return regions->names[region].c_str();
+}
+
+struct region_range_less {
+  bool operator()(uint64_t key, const region_range_t &r) const { return key < r.start; }
+};
+
+int region_lookup(const region_t *regions, int family, const unsigned char *ip, int *scope) {
+  const std::vector<region_range_t> &ranges = regions->ranges[family == 4 ? 0 : 1];
+  uint64_t key = key_of(family, ip);
+  // the last range starting at or before key
+  std::vector<region_range_t>::const_iterator it = std::upper_bound(ranges.begin(), ranges.end(), key, region_range_less());
+  int region = -1;
+  uint64_t lo = 0, hi = ~0ULL; // the range or gap holding key
+  if (it != ranges.begin() && key <= (it - 1)->end) {
+    region = (it - 1)->region;
+    lo = (it - 1)->start;
+    hi = (it - 1)->end;
+  } else {
+    if (it != ranges.begin())
+      lo = (it - 1)->end + 1;
+    if (it != ranges.end())
+      hi = it->start - 1;
+  }
+  if (scope) {
+    int bits = family == 4 ? 32 : 64;
+    for (int len = 0; len <= bits; len++) {
+      uint64_t mask = prefix_mask(len);
+      if ((key & mask) >= lo && ((key & mask) | ~mask) <= hi) {
+        *scope = len;
+        break;
+      }
+    }
+  }
+  return region;
+}
@@ -0,0 +1,31 @@
+#ifndef _REGION_H_
+#define _REGION_H_ 1
+
+// Prefix to region table, for answering EDNS Client Subnet (RFC 7871)
+// queries with nodes close to the client. Loaded once from a text file
+// with lines like
+//
+//   # prefix           region
+//   81.0.0.0/8         eu-west
+//   2a01:4f8::/32      eu-central
+//
+// The more specific prefix wins. Regions whose names agree up to the
+// first '-' form an area, used when a region has too few nodes. IPv6
+// prefixes longer than /64 are cut to /64.
+
+struct region_t;
+
+// NULL, after printing why, if the file cannot be read or parsed
+region_t *region_load(const char *path);
+
+int region_count(const region_t *regions);
+int region_area_count(const region_t *regions);
+int region_area(const region_t *regions, int region);
+const char *region_name(const region_t *regions, int region);
+
+// Region of ip (4 or 16 bytes for family 4 or 6), or -1 if no prefix
+// covers it. If scope is not NULL it is set to the shortest prefix of ip
+// all of whose addresses get the same result.
+int region_lookup(const region_t *regions, int family, const unsigned char *ip, int *scope);
+
+#endif
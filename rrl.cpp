@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+
+#include "rrl.h"
+
+// Number of buckets. Prefixes that hash to the same bucket share its
+// tokens: handing a newcomer a fresh burst would let a spoofer who sprays
+// random sources keep refilling the bucket of the victim it targets.
+#define RRL_BUCKETS (1 << 16)
+
+// A bucket packs into 64 bits so it can be updated with one CAS:
+//   32 bits: time of the last refill, in milliseconds
+//   16 bits: responses limited so far, modulo slip, to pace the slips
+//   16 bits: tokens, in 1/16ths of a response
+#define RRL_SCALE 16
+
+struct rrl_t {
+  uint64_t seed;
+  uint32_t rate;  // in 1/16ths of a response per second
+  uint32_t burst; // in 1/16ths of a response
+  int slip;
+  std::atomic<uint64_t> buckets[RRL_BUCKETS];
+};
+
+static uint64_t mix64(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+rrl_t *rrl_create(int rate, int burst, int slip) {
+  rrl_t *rrl = new rrl_t;
+  // an unpredictable seed, so clients cannot pick prefixes that collide
+  FILE *f = fopen("/dev/urandom", "r");
+  if (!f || fread(&rrl->seed, sizeof(rrl->seed), 1, f) != 1)
+    rrl->seed = ((uint64_t)rand() << 32) ^ rand() ^ time(NULL);
+  if (f)
+    fclose(f);
+  rrl->rate = rate * RRL_SCALE;
+  if (burst < 1) burst = 1;
+  if (burst * RRL_SCALE > 0xFFFF) burst = 0xFFFF / RRL_SCALE;
+  rrl->burst = burst * RRL_SCALE;
+  rrl->slip = slip;
+  for (int i = 0; i < RRL_BUCKETS; i++)
+    rrl->buckets[i].store(0, std::memory_order_relaxed);
+  return rrl;
+}
+
+static uint64_t prefix_key(const struct sockaddr_in6 *addr) {
+  const unsigned char *ip = addr->sin6_addr.s6_addr;
+  uint64_t key = 0;
+  if (IN6_IS_ADDR_V4MAPPED(&addr->sin6_addr)) {
+    // /24
+    key = (1ULL << 56) | ((uint64_t)ip[12] << 16) | ((uint64_t)ip[13] << 8) | ip[14];
+  } else {
+    // /56
+    for (int i = 0; i < 7; i++)
+      key = (key << 8) | ip[i];
+  }
+  return key;
+}
+
+int rrl_check(rrl_t *rrl, const struct sockaddr_in6 *addr) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  uint32_t now = (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+  uint64_t hash = mix64(prefix_key(addr) ^ rrl->seed);
+  std::atomic<uint64_t> &bucket = rrl->buckets[hash & (RRL_BUCKETS - 1)];
+  uint64_t old = bucket.load(std::memory_order_relaxed);
+  int result;
+  do {
+    uint32_t last = old >> 32;
+    uint32_t limited = (old >> 16) & 0xFFFF;
+    uint32_t tokens = old & 0xFFFF;
+    if (old == 0) {
+      // never used: starts full
+      last = now;
+      tokens = rrl->burst;
+    } else {
+      uint32_t elapsed = now - last;
+      uint64_t refill = (uint64_t)elapsed * rrl->rate / 1000;
+      if (refill > 0) {
+        // keep the time of the last refill, so that partial tokens are not lost
+        last = refill >= rrl->burst ? now : last + (uint32_t)(refill * 1000 / rrl->rate);
+        tokens = tokens + refill > rrl->burst ? rrl->burst : tokens + refill;
+      }
+    }
+    if (tokens >= RRL_SCALE) {
+      tokens -= RRL_SCALE;
+      result = RRL_OK;
+    } else if (rrl->slip > 0) {
+      // every slip-th response limited in this bucket slips
+      limited = (limited + 1) % rrl->slip;
+      result = limited == 0 ? RRL_SLIP : RRL_DROP;
+    } else {
+      result = RRL_DROP;
+    }
+    uint64_t val = ((uint64_t)last << 32) | ((uint64_t)limited << 16) | tokens;
+    if (val == old || bucket.compare_exchange_weak(old, val, std::memory_order_relaxed))
+      break;
+  } while(1);
+  return result;
+}
@@ -0,0 +1,26 @@
+#ifndef _RRL_H_
+#define _RRL_H_ 1
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+// Response rate limiting: a token bucket per client prefix (/24 for IPv4,
+// /56 for IPv6), shared by all DNS threads and updated without locks.
+
+enum {
+  RRL_OK = 0,    // answer normally
+  RRL_DROP = 1,  // over the limit: send nothing
+  RRL_SLIP = 2,  // over the limit: send a truncated reply, so real clients retry over TCP
+};
+
+struct rrl_t;
+
+// rate: responses per second per prefix; burst: bucket size in responses
+// slip: every slip-th limited response is sent truncated (0: drop them all)
+rrl_t *rrl_create(int rate, int burst, int slip);
+
+// RRL_OK, RRL_DROP or RRL_SLIP for a response to addr; slips are counted
+// per bucket, so each limited client gets every slip-th response truncated
+int rrl_check(rrl_t *rrl, const struct sockaddr_in6 *addr);
+
+#endif
@@ -0,0 +1,158 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_init(struct uring_t *ring, unsigned entries) {
+  memset(ring, 0, sizeof(*ring));
+  struct io_uring_params p;
+  // deferred task running saves the kernel an interrupt per completion, but
+  // needs 6.1; retry without it on older kernels
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  int fd = sys_io_uring_setup(entries, &p);
+  if (fd < 0 && errno == EINVAL) {
+    memset(&p, 0, sizeof(p));
+    fd = sys_io_uring_setup(entries, &p);
+  }
+  if (fd < 0)
+    return -errno;
+  // refuse kernels that are clearly too old; registering the buffer ring
+  // (5.19) and the first multishot receive (6.0) catch the rest
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_FAST_POLL)) {
+    close(fd);
+    return -ENOSYS;
+  }
+  ring->fd = fd;
+  ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (ring->cq_ring_size > ring->sq_ring_size)
+    ring->sq_ring_size = ring->cq_ring_size;
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    close(fd);
+    return -ENOMEM;
+  }
+  // with SINGLE_MMAP both queues live in one mapping
+  ring->cq_ring = ring->sq_ring;
+  ring->sqes = (struct io_uring_sqe*)mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(fd);
+    return -ENOMEM;
+  }
+  unsigned char *sq = (unsigned char*)ring->sq_ring;
+  ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+  ring->sq_entries = p.sq_entries;
+  // sqe i always sits in array slot i
+  for (unsigned i = 0; i < p.sq_entries; i++)
+    ring->sq_array[i] = i;
+  unsigned char *cq = (unsigned char*)ring->cq_ring;
+  ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  return 0;
+}
+
+void uring_exit(struct uring_t *ring) {
+  munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  if (ring->br)
+    munmap(ring->br, ring->br_entries * sizeof(struct io_uring_buf));
+  close(ring->fd);
+}
+
+int uring_register_file(struct uring_t *ring, int fd) {
+  if (sys_io_uring_register(ring->fd, IORING_REGISTER_FILES, &fd, 1) < 0)
+    return -errno;
+  return 0;
+}
+
+int uring_register_buffers(struct uring_t *ring, int bgid, unsigned char *base, unsigned nbufs, unsigned bufsize) {
+  size_t size = nbufs * sizeof(struct io_uring_buf);
+  void *br = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (br == MAP_FAILED)
+    return -ENOMEM;
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long)br;
+  reg.ring_entries = nbufs;
+  reg.bgid = bgid;
+  if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    int err = errno;
+    munmap(br, size);
+    return -err;
+  }
+  ring->br = (struct io_uring_buf_ring*)br;
+  ring->br_entries = nbufs;
+  ring->br_tail = 0;
+  for (unsigned i = 0; i < nbufs; i++)
+    uring_buffer_recycle(ring, base, bufsize, i, i);
+  uring_buffers_advance(ring, nbufs);
+  return 0;
+}
+
+void uring_buffer_recycle(struct uring_t *ring, unsigned char *base, unsigned bufsize, unsigned bid, unsigned offset) {
+  // not ring->br->bufs: in C++ the kernel header's flexible array sits
+  // behind an empty struct that takes up space
+  struct io_uring_buf *buf = (struct io_uring_buf*)ring->br + ((ring->br_tail + offset) & (ring->br_entries - 1));
+  buf->addr = (unsigned long)(base + (size_t)bid * bufsize);
+  buf->len = bufsize;
+  buf->bid = bid;
+}
+
+void uring_buffers_advance(struct uring_t *ring, unsigned count) {
+  ring->br_tail += count;
+  __atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring_t *ring) {
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *ring->sq_tail + ring->sq_pending;
+  if (tail - head >= ring->sq_entries)
+    return NULL;
+  struct io_uring_sqe *sqe = &ring->sqes[tail & *ring->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_pending++;
+  return sqe;
+}
+
+int uring_submit_and_wait(struct uring_t *ring, unsigned wait) {
+  unsigned submit = ring->sq_pending;
+  if (submit) {
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + submit, __ATOMIC_RELEASE);
+    ring->sq_pending = 0;
+  }
+  int ret = sys_io_uring_enter(ring->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+  return ret < 0 ? -errno : ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring_t *ring) {
+  unsigned head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring_t *ring) {
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
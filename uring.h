@@ -0,0 +1,54 @@
+#ifndef _URING_H_
+#define _URING_H_ 1
+
+#include <linux/io_uring.h>
+
+// Minimal io_uring wrapper on the raw system calls, for one ring used by a
+// single thread: submission and completion queues, one registered file, and
+// one ring of provided buffers for multishot receives.
+
+struct uring_t {
+  int fd;
+  // submission queue
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned sq_entries;
+  unsigned sq_pending; // sqes handed out but not yet submitted
+  struct io_uring_sqe *sqes;
+  // completion queue
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  // provided buffers
+  struct io_uring_buf_ring *br;
+  unsigned br_entries;
+  unsigned short br_tail;
+  // mappings, for uring_exit
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size;
+};
+
+// 0 on success, -errno if the kernel has no (usable) io_uring
+int uring_init(struct uring_t *ring, unsigned entries);
+void uring_exit(struct uring_t *ring);
+
+// register fd as fixed file 0
+int uring_register_file(struct uring_t *ring, int fd);
+
+// register nbufs (a power of two) buffers of bufsize bytes at base as
+// buffer group bgid, and provide them all
+int uring_register_buffers(struct uring_t *ring, int bgid, unsigned char *base, unsigned nbufs, unsigned bufsize);
+
+// give buffer bid back to the kernel; takes effect at uring_buffers_advance
+void uring_buffer_recycle(struct uring_t *ring, unsigned char *base, unsigned bufsize, unsigned bid, unsigned offset);
+void uring_buffers_advance(struct uring_t *ring, unsigned count);
+
+// a zeroed sqe, or NULL if the submission queue is full
+struct io_uring_sqe *uring_get_sqe(struct uring_t *ring);
+
+// submit pending sqes and wait until at least wait completions are ready
+int uring_submit_and_wait(struct uring_t *ring, unsigned wait);
+
+// next completion, or NULL; release it with uring_cqe_seen
+struct io_uring_cqe *uring_peek_cqe(struct uring_t *ring);
+void uring_cqe_seen(struct uring_t *ring);
+
+#endif
@@ -1,8 +1,28 @@
 #include <stdio.h>
+#include <atomic>
 #include "util.h"
 
 using namespace std;
 
+thread_local uint64_t fastRandState[4];
+
+void SeedFastRand()
+{
+    // splitmix64 over the time, the thread and a process-wide counter
+    static std::atomic<uint64_t> nCalls(0);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t seed = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    seed ^= (uint64_t)pthread_self() * 0x9E3779B97F4A7C15ULL;
+    seed ^= nCalls++ << 32;
+    for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        fastRandState[i] = z ^ (z >> 31);
+    }
+}
+
 string vstrprintf(const std::string &format, va_list ap)
 {
     char buffer[50000];
@@ -3,6 +3,8 @@
 
 #include <pthread.h>
 #include <errno.h>
+#include <stdint.h>
+#include <time.h>
 #include <openssl/sha.h>
 #include <stdarg.h>
 
@@ -79,6 +81,39 @@ void static inline Sleep(int nMilliSec) {
     nanosleep(&wa, NULL);
 }
 
+// Milliseconds on a clock that does not jump, for timing intervals
+int64_t static inline GetTimeMillis() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+// Per-thread xoshiro256** generator, for sampling nodes: unlike rand() it
+// takes no lock. Not for anything that needs to be unpredictable.
+extern thread_local uint64_t fastRandState[4];
+void SeedFastRand();
+
+uint64_t static inline GetFastRand() {
+    uint64_t *s = fastRandState;
+    if (!(s[0] | s[1] | s[2] | s[3]))
+        SeedFastRand();
+    uint64_t x = s[1] * 5;
+    uint64_t result = ((x << 7) | (x >> 57)) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = (s[3] << 45) | (s[3] >> 19);
+    return result;
+}
+
+// uniform in [0, n), by multiply-shift instead of a division
+uint32_t static inline GetFastRandRange(uint32_t n) {
+    return ((GetFastRand() >> 32) * n) >> 32;
+}
 
 std::string vstrprintf(const std::string &format, va_list ap);
 